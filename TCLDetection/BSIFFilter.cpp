@@ -99,16 +99,18 @@ void BSIFFilter::generateImage(cv::Mat src, cv::Mat& dst)
 
 
 
-void BSIFFilter::generateHistogram(cv::Mat src, std::vector<int>& histogram)
+void BSIFFilter::generateHistogram(cv::Mat src, std::vector<int>& histogram, stageProfile* profile)
 {
     
     //initializing matrix of 1s
     cv::Mat codeImg = cv::Mat::ones(src.rows, src.cols, CV_64FC1);
     
     // creates the border around the image - it is wrapping
+    stageTimer borderTimer(profile, STAGE_BORDER);
     int border = floor(size/2);
     cv::Mat imgWrap = src;
     cv::copyMakeBorder(src, imgWrap, border, border, border, border, cv::BORDER_WRAP);
+    borderTimer.stop();
     
     /*
     // load the hard-coded filters
@@ -132,6 +134,7 @@ void BSIFFilter::generateHistogram(cv::Mat src, std::vector<int>& histogram)
     // we need to start w/ the last filter and work our way forward
     for (int filterNum = bits - 1; filterNum >= 0; filterNum--)
     {
+        stageTimer convolutionTimer(profile, STAGE_CONVOLUTION);
         
         for (int row=0; row<size; row++)
         {
@@ -145,9 +148,11 @@ void BSIFFilter::generateHistogram(cv::Mat src, std::vector<int>& histogram)
         // running the filter on the image w/ BORDER WRAP - equivalent to filter2 in matlab
         // filter2d will incidentally create another border - we do not want this extra border
         cv::filter2D(imgWrap, ci, CV_64FC1, currentFilter, cv::Point(-1, -1), 0, cv::BORDER_CONSTANT);
+        convolutionTimer.stop();
         
         // This will convert any positive values in the matrix
         // to 2^(i-1) as it did in the matlab software
+        stageTimer thresholdTimer(profile, STAGE_THRESHOLD);
         for (int j = 0; j < src.rows; j++)
         {
             for (int k = 0; k < src.cols; k++)
@@ -163,6 +168,7 @@ void BSIFFilter::generateHistogram(cv::Mat src, std::vector<int>& histogram)
     }
     
     // Creating the histogram
+    stageTimer histogramTimer(profile, STAGE_HISTOGRAM);
     for (int j = 0; j < src.rows; j++)
     {
         for (int k = 0; k < src.cols; k++)
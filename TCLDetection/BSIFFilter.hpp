@@ -15,6 +15,7 @@
 #include <string>
 #include <cstdio>
 #include <iostream>
+#include "stageProfile.hpp"
 
 
 class BSIFFilter
@@ -24,7 +25,11 @@ public:
     
     void loadFilter(int dimension, int bitlength);
     
-    void generateHistogram(cv::Mat src, std::vector<int>& histogram);
+    // True if a filter exists for the dimension and bit length last loaded
+    bool isLoaded(void) const { return myFilter != NULL; }
+    
+    // Adds the codes of the image to the histogram; stages are timed into the profile if one is given
+    void generateHistogram(cv::Mat src, std::vector<int>& histogram, stageProfile* profile = NULL);
     void generateImage(cv::Mat src, cv::Mat& dst);
     
     std::string filtername;
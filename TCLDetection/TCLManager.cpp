@@ -24,11 +24,42 @@ TCLManager::TCLManager(void)
     mapBool["Test images"] = &testImages;
     mapBool["Test list has base truth"] = &hasBaseTruth;
     mapBool["Majority voting"] = &majorityVoting;
+    mapBool["Incremental extraction"] = &incrementalExtraction;
+    mapInt["Checkpoint interval"] = &checkpointInterval;
+    mapBool["Compress features"] = &compressFeatures;
+    mapInt["Compression level"] = &compressionLevel;
+    mapString["Feature file format"] = &featureFormat;
+    mapString["Flat feature type"] = &flatFeatureType;
+    mapString["Histogram cache directory"] = &histogramCacheDir;
+    mapString["Downsampling"] = &downsampling;
+    mapInt["Extraction threads"] = &extractionThreads;
+    mapString["Extraction report"] = &extractionReport;
+    mapInt["Feature cache size"] = &featureCacheMB;
+    mapBool["Feature snapshots"] = &featureSnapshots;
+    mapString["Features in memory"] = &featureMemory;
+    mapInt["Training threads"] = &trainingThreads;
+    mapInt["Training memory budget"] = &trainingMemoryMB;
+    mapString["Parameter search"] = &parameterSearch;
+    mapInt["Halving first folds"] = &halvingFirstFolds;
+    mapInt["Halving rate"] = &halvingRate;
+    mapString["Search log"] = &searchLogFilename;
+    mapString["Random forest tuning"] = &forestTuning;
+    mapString["SVM tuning"] = &svmTuning;
+    mapInt["Streaming batch size"] = &streamBatchRows;
+    mapInt["Streaming epochs"] = &streamEpochs;
+    mapString["Linear SVM regularization"] = &linearRegularizationString;
+    mapString["Projection"] = &projectionMethod;
+    mapInt["Projection dimension"] = &projectionDimension;
     mapString["Segmentation"] = &segmentationType;
     mapString["Model type"] = &modelString;
     mapString["Bitsizes"] = &bitString;
 
     mapString["Image directory"] = &imageDir;
+    mapString["Image archive"] = &imageArchiveFilename;
+    mapString["Stream images from"] = &streamSource;
+    mapInt["Number of shards"] = &numShards;
+    mapInt["Shard index"] = &shardIndex;
+    mapBool["Merge shards"] = &mergeShards;
     mapString["CSV directory"] = &splitDir;
     mapString["Training set filename"] = &trainingSetFilename;
     mapString["Testing set filename"] = &testingSetFilename;
@@ -44,6 +75,10 @@ TCLManager::TCLManager(void)
 
     // Initialize
     initConfig();
+    featureCacheBytes = 0;
+    compactForm = COMPACT_FLOAT;
+    searchThreads = 1;
+    linearRegularization = 1e-4;
 
 }
 
@@ -178,8 +213,60 @@ void TCLManager::showConfig(void)
     {
         cout << "=============" << endl;
         cout << "- Features will be stored in directory: " << outputExtractionDir << endl;
-        cout << "- Feature filenames will be in format: " << outputExtractionFilename + "_filter_size_size_bits.hdf5" << endl;
+        cout << "- Feature filenames will be in format: " << outputExtractionFilename + "_filter_size_size_bits." + featureFormat << endl;
+        if (featureFormat == FORMAT_FLAT)
+        {
+            cout << "- Flat feature files will hold " << (flatFeatureType == "uint16" ? "raw uint16 counts" : "normalized float features") << endl;
+        }
+        if (histogramCacheDir != "")
+        {
+            cout << "- Histograms will be shared through the cache in: " << histogramCacheDir << endl;
+        }
+        if (imageArchiveFilename != "")
+        {
+            cout << "- Images will be read from the archive: " << imageArchiveFilename << endl;
+        }
+        if (mergeShards)
+        {
+            cout << "- The feature files of " << numShards << " shards will be merged" << endl;
+        }
+        else if (numShards > 1)
+        {
+            cout << "- Only shard " << shardIndex << " of " << numShards << " will be extracted" << endl;
+        }
+        if (streamSource == STREAM_STDIN)
+        {
+            cout << "- Image names will be streamed from standard input (instead of the training and testing sets)" << endl;
+        }
+        else if (streamSource != "")
+        {
+            cout << "- Image names will be streamed from lists in the spool directory: " << streamSource << " (instead of the training and testing sets)" << endl;
+        }
         cout << "- Segmentation type: " << segmentationType << endl;
+        if (downsampling == "fast")
+        {
+            cout << "- Even sizes will use fast downsampling (decoder reduction or 2x2 averaging instead of pyrDown)" << endl;
+        }
+        if (extractionThreads > 0)
+        {
+            cout << "- Images will be filtered on " << extractionThreads << " threads" << endl;
+        }
+        else
+        {
+            cout << "- Images will be filtered on one thread per core" << endl;
+        }
+        if (extractionReport != "")
+        {
+            cout << "- Per-stage timings will be reported in: " << extractionReport << endl;
+        }
+        if (incrementalExtraction)
+        {
+            cout << "- Existing feature files will be reused (incremental extraction, checkpoint every " << checkpointInterval << " images)" << endl;
+        }
+        if (compressFeatures)
+        {
+            cout << "- Features will be compressed (shuffle + deflate level " << compressionLevel << ")" << endl;
+        }
         cout << "- Feature sets: " << endl;
         for (int i = 0; i < (int)modelSizes.size(); i++)
         {
@@ -197,6 +284,43 @@ void TCLManager::showConfig(void)
         {
             cout << "   " << generateFilename(i) << "  |  Model type: " << modelTypes[i] << endl;
         }
+        if (trainingThreads > 0)
+        {
+            cout << "- Models will be trained on " << trainingThreads << " threads";
+        }
+        else
+        {
+            cout << "- Models will be trained on one thread per core";
+        }
+        if (trainingMemoryMB > 0)
+        {
+            cout << ", within an estimated " << trainingMemoryMB << " MB" << endl;
+        }
+        else
+        {
+            cout << ", with no memory limit" << endl;
+        }
+        if (std::find(modelTypes.begin(), modelTypes.end(), "lsvm") != modelTypes.end())
+        {
+            cout << "- Linear SVMs will be trained on batches of " << streamBatchRows << " images streamed from the feature files (" << streamEpochs << " epochs, regularization " << linearRegularizationString << ")" << endl;
+        }
+        if (projectionMethod != "none")
+        {
+            cout << "- Histograms of more than " << projectionDimension << " bins will be reduced to " << projectionDimension << " dimensions by " << (projectionMethod == "pca" ? "PCA" : "random projection") << " (except for linear SVMs)" << endl;
+        }
+        if (svmTuning == "shared")
+        {
+            cout << "- SVM parameters will be searched in parallel on kernel values shared by all candidates and folds" << endl;
+        }
+        if (forestTuning == "oob")
+        {
+            cout << "- Random forest parameters will be chosen by out-of-bag error (each candidate trained once, the best kept)" << endl;
+        }
+        if (parameterSearch == "halving")
+        {
+            cout << "- Random forest and multilayer perceptron parameters will be searched by successive halving (" << halvingFirstFolds << " first folds, rate " << halvingRate << ")" << endl;
+            cout << "- Promotions will be logged " << (searchLogFilename == "" ? "here" : "in: " + searchLogFilename) << endl;
+        }
         cout << "=============" << endl;
     }
 
@@ -221,6 +345,41 @@ void TCLManager::showConfig(void)
         cout << "=============" << endl;
     }
 
+    if ((trainModel || testImages) && (featureCacheMB > 0))
+    {
+        cout << "- Loaded features will be kept in memory for other models (up to " << featureCacheMB << " MB)" << endl;
+    }
+    if ((trainModel || testImages) && (featureMemory != "float"))
+    {
+        cout << "- Features will be held in memory as " << featureMemory << " and expanded to float32 when used" << endl;
+    }
+    if ((trainModel || testImages) && featureSnapshots)
+    {
+        cout << "- Normalized features will be loaded from (or saved to) snapshots next to the feature files" << endl;
+    }
+
+}
+
+
+
+
+
+// Predicts all rows of compact features, expanding one block of rows to float32 at a time (and projecting it, for a model
+// trained on projected features)
+static void predictRows(const Ptr<StatModel>& model, const compactFeatures& features, const featureProjection* projection, cv::Mat& results)
+{
+    for (int first = 0; first < features.rows(); first += COMPACT_BLOCK_ROWS)
+    {
+        int last = std::min(first + COMPACT_BLOCK_ROWS, features.rows());
+        cv::Mat block = features.block(first, last);
+        if (projection)
+        {
+            block = projection->apply(block);
+        }
+        cv::Mat blockResults;
+        model->predict(block, blockResults);
+        blockResults.copyTo(results.rowRange(first, last));
+    }
 }
 
 
@@ -247,140 +406,225 @@ void TCLManager::run(void)
         throw e;
     }
     
+    // Feature sets and models are pairs of a size and a bit size
+    if (modelSizes.size() != bitSizes.size())
+    {
+        throw runtime_error("Error: " + std::to_string(modelSizes.size()) + " sizes but " + std::to_string(bitSizes.size()) + " bit sizes in the configuration");
+    }
+    
 
     if (extractFeatures)
     {
 
         std::cout << "Extracting features..." << std::endl;
 
-        // Concatenate lists of files
+        // Concatenate lists of files (an image in both sets is extracted once)
         std::vector<std::string> extractionFilenames;
-        extractionFilenames.insert(extractionFilenames.end(), trainingSet.begin(), trainingSet.end());
-        extractionFilenames.insert(extractionFilenames.end(), testingSet.begin(), testingSet.end());
-
-        for (int i = 0; i < (int)bitSizes.size(); i++)
+        std::unordered_set<std::string> listed;
+        for (int i = 0; i < (int)(trainingSet.size() + testingSet.size()); i++)
         {
-            cout << "Extracting..." << bitSizes[i] << "," << modelSizes[i] << endl;
-            // Declare new feature extractor
-            featureExtractor newExtractor(bitSizes[i], extractionFilenames, segmentationType);
-
-            // Extract
-            try
-            {
-                newExtractor.extract(outputExtractionDir, outputExtractionFilename, imageDir, modelSizes[i]);
-            }
-            catch (runtime_error& e)
+            const std::string& name = (i < (int)trainingSet.size()) ? trainingSet[i] : testingSet[i - trainingSet.size()];
+            if (listed.insert(name).second)
             {
-                throw e;
+                extractionFilenames.push_back(name);
             }
         }
 
-    }
-
-    
-    if (trainModel)
-    {
-        
-        // Loop through modelSizes vector to train required models
-        for (int i = 0; i < (int)modelSizes.size(); i++)
+        // Incremental extraction and checkpointing
+        extractionOptions options;
+        options.incremental = incrementalExtraction;
+        options.checkpointInterval = checkpointInterval;
+        options.compress = compressFeatures;
+        options.compressionLevel = compressionLevel;
+        options.format = featureFormat;
+        options.cacheDir = histogramCacheDir;
+        options.archiveFilename = imageArchiveFilename;
+        options.numThreads = extractionThreads;
+        options.reportFilename = extractionReport;
+        if (flatFeatureType == "float")
+        {
+            options.flatType = FLAT_FLOAT;
+        }
+        else if (flatFeatureType == "uint16")
         {
-            std::cout << "Training model " << (i + 1) << " out of " << modelSizes.size() << "..." << endl;
+            options.flatType = FLAT_UINT16;
+        }
+        else
+        {
+            throw runtime_error("Error: invalid flat feature type " + flatFeatureType);
+        }
 
+        if (downsampling == "exact")
+        {
+            options.exactDownsampling = true;
+        }
+        else if (downsampling == "fast")
+        {
+            options.exactDownsampling = false;
+        }
+        else
+        {
+            throw runtime_error("Error: invalid downsampling " + downsampling);
+        }
 
-            // Load training data for current size
-            cv::Mat featuresTrain;
-            cv::Mat classesTrain;
+        if ((numShards < 1) || (shardIndex < 0) || (shardIndex >= numShards))
+        {
+            throw runtime_error("Error: invalid shard " + std::to_string(shardIndex) + " of " + std::to_string(numShards));
+        }
+        if ((numShards > 1) && (streamSource != ""))
+        {
+            throw runtime_error("Error: streaming extraction cannot be sharded");
+        }
+        if ((numShards > 1) && ! mergeShards && (histogramCacheDir != ""))
+        {
+            // Shard processes would open the same cache files for writing at once, which HDF5 does not support
+            throw runtime_error("Error: sharded extraction cannot use a histogram cache directory");
+        }
 
-            try
-            {
-                loadFeatures(featuresTrain, classesTrain, modelSizes[i], TRAIN, bitSizes[i]);
-            }
-            catch (runtime_error& e)
-            {
-                throw e;
-            }
+        // Sharded extraction: each shard extracts a contiguous part of the images into its own feature files
+        std::string extractionPrefix = outputExtractionFilename;
+        if ((numShards > 1) && ! mergeShards)
+        {
+            size_t first = extractionFilenames.size() * shardIndex / numShards;
+            size_t last = extractionFilenames.size() * (shardIndex + 1) / numShards;
+            extractionFilenames = std::vector<std::string>(extractionFilenames.begin() + first, extractionFilenames.begin() + last);
+            extractionPrefix = shardPrefix(outputExtractionFilename, shardIndex, numShards);
+        }
 
+        // Declare one feature extractor for all feature sets (each image is decoded once)
+        featureExtractor newExtractor(extractionFilenames, segmentationType, options);
 
-            if (modelTypes[i] == "svm")
+        // Extract the training and testing sets, or the images streamed in, or merge the shards
+        try
+        {
+            if (mergeShards)
             {
-                std::cout << "  BSIF size " << modelSizes[i] << " Bit size " << bitSizes[i] << " | SVM with Kernel RBF " << endl;
-
-                // Place into trainData
-                Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, classesTrain);
-
-                // Create new SVM
-                Ptr<SVM> svmGauss = SVM::create();
-
-                // Set parameters
-                svmGauss->setType(SVM::C_SVC);
-                svmGauss->setKernel(SVM::RBF);
-
-
-                // Train model and save
-                svmGauss->trainAuto(trainingData);
-                
-                svmGauss->save(modelOutputDir + generateFilename(i));
+                cout << "Merging " << numShards << " shards of " << bitSizes.size() << " feature sets..." << endl;
+                newExtractor.merge(outputExtractionDir, outputExtractionFilename, modelSizes, bitSizes, numShards);
             }
-            else if (modelTypes[i] == "rf")
+            else if (streamSource != "")
             {
-                std::cout << "  BSIF size " << modelSizes[i] << " Bit Sizes " << bitSizes[i] << " | Random Forest " << endl;
-
-                // Place into trainData
-                Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, classesTrain);
-
-                // Create new Random Forest
-                Ptr<RTrees> rForest = RTrees::create();
-                
-                // Train model and save
-                trainAuto_rf(trainingData, rForest);
-                
-                rForest->save(modelOutputDir + generateFilename(i));
-                
-                
+                cout << "Extracting " << bitSizes.size() << " feature sets..." << endl;
+                newExtractor.stream(outputExtractionDir, outputExtractionFilename, imageDir, modelSizes, bitSizes, streamSource);
             }
-            else if (modelTypes[i] == "mp")
+            else
             {
-               std::cout << "  BSIF size " << modelSizes[i] << " bit size " << bitSizes[i] << " | Multilayer Perceptron" << endl;
+                cout << "Extracting " << bitSizes.size() << " feature sets of " << extractionFilenames.size() << " images..." << endl;
+                newExtractor.extract(outputExtractionDir, extractionPrefix, imageDir, modelSizes, bitSizes);
 
-                // Place into trainData (need two responses (.8,-.8) and (-.8,.8))
-                cv::Mat nnResponses(classesTrain.rows, 2, CV_32FC1);
-
-                for (int i = 0; i < classesTrain.rows; i++)
+                // A shard is complete once its manifest exists
+                if (numShards > 1)
                 {
-                    if (classesTrain.at<int>(i,0) == 1)
-                    {
-                        // Textured
-                        nnResponses.at<float>(i,0) = 0.8;
-                        nnResponses.at<float>(i,1) = -0.8;
-                    }
-                    else if (classesTrain.at<int>(i,0) == 0)
-                    {
-                        // Clear or none
-                        nnResponses.at<float>(i,0) = -0.8;
-                        nnResponses.at<float>(i,1) = 0.8;
-                    }
+                    writeShardManifest(outputExtractionDir + outputExtractionFilename, shardIndex, numShards, extractionFilenames);
                 }
-                Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, nnResponses);
-                
-                
-
-                // Train MLP and save
-                
-                Ptr<ANN_MLP> autoMLP = ANN_MLP::create();
-                trainAuto_mlp(trainingData, autoMLP);
-                autoMLP->save(modelOutputDir + generateFilename(i));
-                
             }
+        }
+        catch (runtime_error& e)
+        {
+            throw e;
+        }
+
+    }
 
+    
+    // Form of the feature matrices held in memory for training and testing
+    if (featureMemory == "float")
+    {
+        compactForm = COMPACT_FLOAT;
+    }
+    else if (featureMemory == "uint16")
+    {
+        compactForm = COMPACT_UINT16;
+    }
+    else if (featureMemory == "float16")
+    {
+        compactForm = COMPACT_FLOAT16;
+    }
+    else
+    {
+        throw runtime_error("Error: invalid form of features in memory " + featureMemory);
+    }
+    
+    // Linear SVMs: batches streamed from the feature files, for training and testing
+    if (std::find(modelTypes.begin(), modelTypes.end(), "lsvm") != modelTypes.end())
+    {
+        try
+        {
+            linearRegularization = std::stod(linearRegularizationString);
+        }
+        catch (std::exception&)
+        {
+            throw runtime_error("Error: invalid linear SVM regularization " + linearRegularizationString);
+        }
+        if ((linearRegularization <= 0) || (streamBatchRows < 1) || (streamEpochs < 1))
+        {
+            throw runtime_error("Error: linear SVMs need a positive regularization, streaming batch size and number of epochs");
+        }
+    }
+    
+    if (trainModel)
+    {
+        
+        if ((parameterSearch != "grid") && (parameterSearch != "halving"))
+        {
+            throw runtime_error("Error: invalid parameter search " + parameterSearch);
+        }
+        if ((parameterSearch == "halving") && ((halvingFirstFolds < 1) || (halvingRate < 2)))
+        {
+            throw runtime_error("Error: successive halving needs at least 1 first fold and a rate of at least 2");
+        }
+        if ((forestTuning != "cv") && (forestTuning != "oob"))
+        {
+            throw runtime_error("Error: invalid random forest tuning " + forestTuning);
+        }
+        if ((svmTuning != "trainAuto") && (svmTuning != "shared"))
+        {
+            throw runtime_error("Error: invalid SVM tuning " + svmTuning);
+        }
+        if ((projectionMethod != "none") && (projectionMethod != "pca") && (projectionMethod != "random"))
+        {
+            throw runtime_error("Error: invalid projection " + projectionMethod);
+        }
+        if ((projectionMethod != "none") && (projectionDimension < 1))
+        {
+            throw runtime_error("Error: the projection dimension must be positive");
+        }
+        
+        // Ensemble members are independent: each is a task of the scheduler, the largest first,
+        // run as soon as a thread is free and its estimated memory fits in the training budget
+        taskScheduler trainer(trainingThreads);
+        memoryBudget budget((size_t)std::max(trainingMemoryMB, 0) << 20);
+        std::atomic<int> modelsDone(0);
+        int numModels = (int)modelSizes.size();
+        
+        // Cores left to each model for its parameter search (random forest and multilayer perceptron): all of them for a
+        // single model, none beyond its own thread once the ensemble fills every core
+        searchThreads = std::max(1, (int)std::thread::hardware_concurrency() / std::max(1, std::min(trainer.threadCount(), numModels)));
+        
+        std::cout << "Training " << numModels << " models on " << std::min(trainer.threadCount(), numModels) << " threads..." << endl;
+        
+        for (int i = 0; i < numModels; i++)
+        {
+            size_t bytes = trainingBytes(i);
+            trainer.add((double)bytes, [this, i, bytes, numModels, &budget, &modelsDone]()
+            {
+                memoryReservation reservation(budget, bytes);
+                trainEnsembleMember(i);
+                
+                std::lock_guard<std::mutex> guard(trainingLock);
+                std::cout << "  Saved " << generateFilename(i) << " (" << ++modelsDone << " out of " << numModels << " models trained)" << endl;
+            });
         }
+        
+        trainer.run();
     }
     
     if (testImages)
     {
         std::cout << "Testing images..." << endl << endl;
         
-        // Mat objects for testing data
-        cv::Mat featuresTest;
+        // Testing data (features kept compact, expanded a block of rows at a time for prediction)
+        compactFeatures featuresTest;
         cv::Mat classesTest;
         
         // Results vector
@@ -407,6 +651,10 @@ void TCLManager::run(void)
                 {
                     currentModel = Algorithm::load<ANN_MLP>(modelOutputDir + generateFilename(i));
                 }
+                else if (modelTypes[i] == "lsvm")
+                {
+                    currentModel = Algorithm::load<linearSVM>(modelOutputDir + generateFilename(i));
+                }
                 
             }
             else
@@ -414,6 +662,16 @@ void TCLManager::run(void)
                 throw runtime_error("Error: Model \"" + generateFilename(i) + "\" not found.");
             }
             
+            // Linear SVMs predict from features streamed a batch at a time, never holding the whole testing set
+            if (modelTypes[i] == "lsvm")
+            {
+                classesTest = setLabels(TEST);
+                cv::Mat individualResults(classesTest.rows, 1, CV_32FC1);
+                streamPredictions(currentModel, modelSizes[i], TEST, bitSizes[i], individualResults);
+                results.push_back(individualResults);
+                continue;
+            }
+            
             // Load testing features
             try
             {
@@ -424,6 +682,17 @@ void TCLManager::run(void)
                 throw e;
             }
             
+            // A model with fewer inputs than histogram bins was trained on projected features: project them the same way
+            std::shared_ptr<featureProjection> projection;
+            if (currentModel->getVarCount() != (1 << bitSizes[i]))
+            {
+                projection = modelProjection(i, NULL);
+                if ((projection->inputs() != (1 << bitSizes[i])) || (projection->outputs() != currentModel->getVarCount()))
+                {
+                    throw runtime_error("Error: projection \"" + projectionFilename(i) + "\" does not match model \"" + generateFilename(i) + "\"");
+                }
+            }
+            
             
             if (modelTypes[i] == "mp")
             {
@@ -431,7 +700,7 @@ void TCLManager::run(void)
                 cv::Mat individualResults(classesTest.rows, 2, CV_32FC1);
                 
                 // Predict using model
-                currentModel->predict(featuresTest, individualResults);
+                predictRows(currentModel, featuresTest, projection.get(), individualResults);
                 
                 // Convert back to 0 or 1
                 for (int j = 0; j < classesTest.rows; j++)
@@ -460,7 +729,7 @@ void TCLManager::run(void)
                 cv::Mat individualResults(classesTest.rows, classesTest.cols, CV_32FC1);
                 
                 // Predict using model
-                currentModel->predict(featuresTest, individualResults);
+                predictRows(currentModel, featuresTest, projection.get(), individualResults);
                 
                 // Add results to results vector
                 results.push_back(individualResults);
@@ -614,10 +883,38 @@ void TCLManager::initConfig(void)
     trainModel = false;
     testImages = false;
     majorityVoting = false;
+    incrementalExtraction = false;
+    checkpointInterval = 500;
+    compressFeatures = false;
+    compressionLevel = 4;
+    featureFormat = FORMAT_HDF5;
+    flatFeatureType = "float";
+    downsampling = "exact";
+    extractionThreads = 0;
+    featureCacheMB = 2048;
+    featureSnapshots = false;
+    featureMemory = "float";
+    trainingThreads = 0;
+    trainingMemoryMB = 8192;
+    parameterSearch = "grid";
+    halvingFirstFolds = 2;
+    halvingRate = 3;
+    forestTuning = "cv";
+    svmTuning = "trainAuto";
+    streamBatchRows = 4096;
+    streamEpochs = 5;
+    linearRegularizationString = "0.0001";
+    projectionMethod = "none";
+    projectionDimension = 256;
     segmentationType = "wi";
 
     // Inputs
     imageDir = "";
+    imageArchiveFilename = "";
+    streamSource = "";
+    numShards = 1;
+    shardIndex = 0;
+    mergeShards = false;
     splitDir = "";
     trainingSetFilename = "";
     testingSetFilename = "";
@@ -628,6 +925,9 @@ void TCLManager::initConfig(void)
     // Outputs
     outputExtractionFilename = "";
     outputExtractionDir = "";
+    histogramCacheDir = "";
+    extractionReport = "";
+    searchLogFilename = "";
     modelOutputDir = "";
 }
 
@@ -638,9 +938,6 @@ void TCLManager::initConfig(void)
 // Loads the training/testing image names indicated in the config file
 void TCLManager::loadSets(void)
 {
-    string currentName;
-    size_t location;
-
     // Clear
     trainingSet.clear();
     trainingClass.clear();
@@ -650,24 +947,7 @@ void TCLManager::loadSets(void)
     // Training sets
     if (trainingSetFilename != "")
     {
-
-        ifstream train;
-        train.open(splitDir + trainingSetFilename);
-
-        if (! train.good())
-        {
-            throw runtime_error("Error: training split not found in " + trainingSetFilename);
-        }
-
-        while (getline(train, currentName))
-        {
-            location = currentName.find(",");
-            trainingSet.push_back(currentName.substr(0, location));
-            trainingClass.push_back(stoi(currentName.substr((location + 1))));
-        }
-
-        train.close();
-
+        readSplit(trainingSetFilename, true, trainingSet, trainingClass);
     } else if (trainModel)
     {
         // if model training is requested but no file is given
@@ -677,24 +957,7 @@ void TCLManager::loadSets(void)
     // Testing sets
     if (testingSetFilename != "")
     {
-
-        ifstream test;
-        test.open(splitDir + testingSetFilename);
-        currentName = "";
-
-        if (! test.good())
-        {
-            throw runtime_error("Error: testing split not found in " + testingSetFilename);
-        }
-
-        while (getline(test, currentName))
-        {
-            location = currentName.find(",");
-            testingSet.push_back(currentName.substr(0, location));
-            if (hasBaseTruth) testingClass.push_back(stoi(currentName.substr((location + 1))));
-        }
-        test.close();
-
+        readSplit(testingSetFilename, hasBaseTruth, testingSet, testingClass);
     } else if (testImages)
     {
         // if image testing is requested but no file is given
@@ -707,283 +970,1021 @@ void TCLManager::loadSets(void)
 
 
 
-// Loads features for training or testing sets into Mat objects
-void TCLManager::loadFeatures(cv::Mat& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType)
+// Reads a split: packed in the image archive if it is there, otherwise from the CSV directory
+// Either way it is parsed straight from mapped memory
+void TCLManager::readSplit(const std::string& filename, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes)
 {
+    if (imageArchiveFilename != "")
+    {
+        imageArchive archive(imageArchiveFilename);
+        const unsigned char* data;
+        size_t length;
+        if (archive.find(filename, data, length))
+        {
+            parseSplit((const char*)data, length, filename, withClasses, names, classes);
+            return;
+        }
+    }
+    loadSplitFile(splitDir + filename, withClasses, names, classes);
+}
 
-    // Determine set types
-    vector<string>* fileSet;
-    vector<int>* classSet;
 
-    switch (setType)
+
+
+
+// Loads features for training or testing sets into Mat objects, through the in-memory feature cache
+void TCLManager::loadFeatures(compactFeatures& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType)
+{
+    std::string key = std::to_string(filtersize) + "_" + std::to_string(bitType) + "_" + std::to_string(setType);
+
+    // Already loaded: mark as most recently used and share the matrices (models do not modify their features)
+    std::map<std::string, std::list<loadedFeatures>::iterator>::iterator found = featureCacheIndex.find(key);
+    if (found != featureCacheIndex.end())
     {
-        case TRAIN:
-            fileSet = &trainingSet;
-            classSet = &trainingClass;
-            break;
-        case TEST:
-            fileSet = &testingSet;
-            classSet = &testingClass;
-            break;
-        default:
-            fileSet = NULL;
-            classSet = NULL;
-            throw runtime_error("Error: Invalid set type");
+        featureCache.splice(featureCache.begin(), featureCache, found->second);
+        outputFeatures = found->second->features;
+        outputLabels = found->second->labels;
+        cout << "  Features reused from memory" << endl;
+        return;
     }
 
-    // Allocate storage for the output features (rows = number of samples, columns = size of histogram) and for output labels
-    outputFeatures.create((int)(*fileSet).size(), pow(2,bitType), CV_32FC1);
-    outputLabels.create((int)(*classSet).size(), 1, CV_32SC1);
-    
-    std::vector<int> histogram(pow(2,bitType), 0);
+    readFeatures(outputFeatures, outputLabels, filtersize, setType, bitType);
 
-    
-    // HDF5 Version
-    
-    // Load files
-    stringstream featureFilename;
-    featureFilename << outputExtractionDir << outputExtractionFilename << "_filter_" << filtersize << "_" << filtersize << "_" << bitType << ".hdf5";
-    string featureName = featureFilename.str();
-    const char* file_to_open = featureName.c_str();
-    
-    hid_t       file_id;   /* file identifier */
-    hid_t     dataset_id;
-    herr_t      status;
-    
-    
-    
-    // Open existing file
-    try {
-        file_id = H5Fopen(file_to_open, H5F_ACC_RDWR, H5P_DEFAULT);
-    } catch (runtime_error e) {
-        throw runtime_error("Error: no features found in given directory");
+    if (featureCacheMB <= 0)
+    {
+        return;
     }
-    
-    // Loop through file set
-    for (int i = 0; i < (int)(*fileSet).size(); i++)
+
+    loadedFeatures entry;
+    entry.key = key;
+    entry.features = outputFeatures;
+    entry.labels = outputLabels;
+    featureCache.push_front(entry);
+    featureCacheIndex[key] = featureCache.begin();
+    featureCacheBytes += outputFeatures.bytes() + outputLabels.total() * outputLabels.elemSize();
+
+    // Evict the least recently used matrices beyond the memory cap (a matrix larger than the cap is not kept at all)
+    size_t capBytes = (size_t)featureCacheMB << 20;
+    while ((featureCacheBytes > capBytes) && ! featureCache.empty())
     {
-        const char* dataset_to_open = (*fileSet)[i].c_str();
-        // open dataset for specific image
-        dataset_id = H5Dopen2(file_id, dataset_to_open, H5P_DEFAULT); // returns negative value if unsuccessful (image features not found)
-        
-        if (dataset_id >= 0) // features were found
-        {
-            status = H5Dread(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &histogram[0]);
-        }
-        else
+        loadedFeatures& oldest = featureCache.back();
+        featureCacheBytes -= oldest.features.bytes() + oldest.labels.total() * oldest.labels.elemSize();
+        featureCacheIndex.erase(oldest.key);
+        featureCache.pop_back();
+    }
+}
+
+
+// Classes of a set as a column (a new matrix, since matrices loaded earlier may be shared with the feature cache)
+// don't load labels for the test set if it doesn't have any (they are left at 0)
+cv::Mat TCLManager::setLabels(int setType)
+{
+    vector<int>& classSet = (setType == TRAIN) ? trainingClass : testingClass;
+    cv::Mat labels = cv::Mat::zeros((int)((setType == TRAIN) ? trainingSet : testingSet).size(), 1, CV_32SC1);
+    if (hasBaseTruth || (setType == TRAIN))
+    {
+        for (int i = 0; i < (int)classSet.size(); i++)
         {
-            status = H5Dclose(dataset_id);
-            status = H5Fclose(file_id);
-            throw runtime_error("Error: features not found in given directory");
-            //TODO: extract new features
+            labels.at<int>(i,0) = classSet[i];
+        }
+    }
+    return labels;
+}
+
+
+// Opens the features of a set to be read a batch of rows at a time
+std::unique_ptr<featureStream> TCLManager::openFeatureStream(int filtersize, int setType, int bitType)
+{
+    string featureName = featureFilename(outputExtractionDir + outputExtractionFilename, filtersize, bitType, featureFormat);
+    vector<string>& fileSet = (setType == TRAIN) ? trainingSet : testingSet;
+    return std::unique_ptr<featureStream>(new featureStream(featureName, featureFormat, fileSet, pow(2,bitType)));
+}
+
+
+// Trains a linear SVM out of core: the training features are streamed from the feature file a batch at a time
+void TCLManager::trainLinearSVM(int i)
+{
+    std::unique_ptr<featureStream> stream;
+    {
+        std::lock_guard<std::mutex> guard(trainingLock);
+        stream = openFeatureStream(modelSizes[i], TRAIN, bitSizes[i]);
+    }
+    
+    Ptr<linearSVM> lsvm = linearSVM::create();
+    lsvm->setRegularization(linearRegularization);
+    lsvm->setEpochs(streamEpochs);
+    
+    // Batches are read with the lock held (the HDF5 library is not thread-safe), and trained on without it
+    lsvm->trainBatches(stream->rows(), stream->cols(), streamBatchRows, trainingClass, [&](int first, int last)
+    {
+        std::lock_guard<std::mutex> guard(trainingLock);
+        return stream->batch(first, last);
+    });
+    
+    lsvm->save(modelOutputDir + generateFilename(i));
+}
+
+
+// Predicts all rows of a set with a model, streaming the features a batch at a time
+void TCLManager::streamPredictions(const Ptr<StatModel>& model, int filtersize, int setType, int bitType, cv::Mat& results)
+{
+    std::unique_ptr<featureStream> stream = openFeatureStream(filtersize, setType, bitType);
+    for (int first = 0; first < stream->rows(); first += streamBatchRows)
+    {
+        int last = std::min(first + streamBatchRows, stream->rows());
+        cv::Mat blockResults;
+        model->predict(stream->batch(first, last), blockResults);
+        blockResults.copyTo(results.rowRange(first, last));
+    }
+}
+
+
+// Reads features for training or testing sets into Mat objects
+void TCLManager::readFeatures(compactFeatures& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType)
+{
+
+    // Determine set types
+    vector<string>* fileSet;
+    vector<int>* classSet;
+
+    switch (setType)
+    {
+        case TRAIN:
+            fileSet = &trainingSet;
+            classSet = &trainingClass;
+            break;
+        case TEST:
+            fileSet = &testingSet;
+            classSet = &testingClass;
+            break;
+        default:
+            fileSet = NULL;
+            classSet = NULL;
+            throw runtime_error("Error: Invalid set type");
+    }
+
+    // Load classes into Mat
+    outputLabels = setLabels(setType);
+    
+    string featureName = featureFilename(outputExtractionDir + outputExtractionFilename, filtersize, bitType, featureFormat);
+    
+    // Flat feature files stay mapped, since loaded features may wrap their memory
+    if ((featureFormat == FORMAT_FLAT) && (flatFeatureFiles.find(featureName) == flatFeatureFiles.end()))
+    {
+        flatFeatureFiles[featureName] = std::make_shared<flatFeatureFile>(featureName);
+        if (flatFeatureFiles[featureName]->cols() != pow(2,bitType))
+        {
+            throw runtime_error("Error: unexpected number of features in " + featureName);
+        }
+    }
+    
+    // Compact uint16: raw counts, normalized whenever rows are expanded
+    if (compactForm == COMPACT_UINT16)
+    {
+        cv::Mat counts = (featureFormat == FORMAT_FLAT) ? flatFeatureFiles[featureName]->counts(*fileSet) : loadHDF5Counts(featureName, *fileSet, pow(2,bitType));
+        if (! counts.empty())
+        {
+            outputFeatures = compactFeatures::fromCounts(counts);
+            return;
+        }
+        cout << "  Counts do not fit in 16 bits, or the feature file holds normalized floats: features kept as float32" << endl;
+    }
+    
+    // Snapshot of the normalized features of this split, next to the feature file
+    // Used only if neither the feature file nor the split changed since it was written
+    string splitFilename = (setType == TRAIN) ? trainingSetFilename : testingSetFilename;
+    std::replace(splitFilename.begin(), splitFilename.end(), '/', '_');
+    string snapshotName = featureName + "." + splitFilename + ".snapshot";
+    uint64_t splitId = splitHash(*fileSet, *classSet);
+    cv::Mat features;
+    if (featureSnapshots && readFeatureSnapshot(snapshotName, featureName, splitId, features, outputLabels))
+    {
+        cout << "  Features loaded from snapshot " << snapshotName << endl;
+    }
+    else
+    {
+        if (featureFormat == FORMAT_FLAT)
+        {
+            // Flat version: features come straight from the mapped file
+            features = flatFeatureFiles[featureName]->features(*fileSet);
+        }
+        else
+        {
+            // HDF5 version: each histogram is read directly into its row of the matrix, then all rows are normalized in one pass
+            features = loadHDF5Features(featureName, *fileSet, pow(2,bitType));
         }
         
-        // Close dataset
-        status = H5Dclose(dataset_id);
+        // A snapshot only speeds up later runs: if it cannot be written (read-only directory, full disk), carry on without it
+        if (featureSnapshots)
+        {
+            try
+            {
+                writeFeatureSnapshot(snapshotName, featureName, splitId, features, outputLabels);
+            }
+            catch (runtime_error& e)
+            {
+                cout << "  " << e.what() << " (continuing without a snapshot)" << endl;
+            }
+        }
+    }
+    
+    outputFeatures = compactFeatures(features, (compactForm == COMPACT_FLOAT16) ? COMPACT_FLOAT16 : COMPACT_FLOAT);
+
+}
+
+
+// Peak memory estimate of training a model: the float32 training matrix and the folds laid out while searching parameters
+// (plus the training sets of the folds and the weights and their updates for a multilayer perceptron, in doubles, up to 4 times the features in the hidden layer,
+// for each search thread, or the squared distances between all training samples for an SVM searched on a shared kernel)
+// With a projection, the features the model trains on have the projection dimension
+// A linear SVM only holds a batch of features
+size_t TCLManager::trainingBytes(int i)
+{
+    size_t rows = trainingSet.size();
+    size_t cols = (size_t)1 << bitSizes[i];
+    if (modelTypes[i] == "lsvm")
+    {
+        // One batch of features, and the weights with their average
+        return (size_t)streamBatchRows * cols * sizeof(float) + 2 * cols * sizeof(double);
+    }
+    size_t bytes = 0;
+    if (projectsFeatures(i))
+    {
+        // The histograms expanded to float32 to be projected, and the covariance matrix of PCA (samples x samples
+        // when there are fewer samples than bins), in doubles; the model then trains on projected features
+        bytes += rows * cols * sizeof(float) + std::min(rows, cols) * std::min(rows, cols) * sizeof(double);
+        cols = (size_t)projectionDimension;
+    }
+    bytes += TRAINING_MEMORY_COPIES * rows * cols * sizeof(float);
+    if (modelTypes[i] == "mp")
+    {
+        // The training sets of the 10 folds, each 9/10 of the samples, copied for the whole search
+        bytes += 9 * rows * cols * sizeof(float);
+        bytes += searchThreads * 2 * (cols * 4 * cols + 4 * cols * 2) * sizeof(double);
+    }
+    if ((modelTypes[i] == "svm") && (svmTuning == "shared"))
+    {
+        bytes += rows * rows * sizeof(float);
+    }
+    return bytes;
+}
+
+
+// Trains one model of the ensemble and saves it (runs on any thread of the training scheduler)
+void TCLManager::trainEnsembleMember(int i)
+{
+    // Load training data for current size (feature loading and console output are serialized between threads)
+    compactFeatures compactTrain;
+    cv::Mat classesTrain;
+    {
+        std::lock_guard<std::mutex> guard(trainingLock);
+        std::cout << "Training model " << (i + 1) << " out of " << modelSizes.size() << "..." << endl;
         
-        // Store histogram in Mat object
-        for (int j = 0; j < (int)(histogram).size(); j++)
+        if (modelTypes[i] == "svm")
+        {
+            std::cout << "  BSIF size " << modelSizes[i] << " Bit size " << bitSizes[i] << " | SVM with Kernel RBF " << endl;
+        }
+        else if (modelTypes[i] == "rf")
+        {
+            std::cout << "  BSIF size " << modelSizes[i] << " Bit Sizes " << bitSizes[i] << " | Random Forest " << endl;
+        }
+        else if (modelTypes[i] == "mp")
+        {
+            std::cout << "  BSIF size " << modelSizes[i] << " bit size " << bitSizes[i] << " | Multilayer Perceptron" << endl;
+        }
+        else if (modelTypes[i] == "lsvm")
+        {
+            std::cout << "  BSIF size " << modelSizes[i] << " bit size " << bitSizes[i] << " | Linear SVM (streamed, batches of " << streamBatchRows << " images)" << endl;
+        }
+        
+        if (modelTypes[i] != "lsvm")
+        {
+            loadFeatures(compactTrain, classesTrain, modelSizes[i], TRAIN, bitSizes[i]);
+        }
+    }
+    
+    // Linear SVMs never hold the whole training set
+    if (modelTypes[i] == "lsvm")
+    {
+        trainLinearSVM(i);
+        return;
+    }
+    
+    // Models train on float32: expanded for this model only, while the loaded features stay compact
+    cv::Mat featuresTrain = compactTrain.toFloat();
+    
+    // High bit histograms are reduced by the projection of their size and bits (fitted by the first model that needs it)
+    if (projectsFeatures(i))
+    {
+        featuresTrain = modelProjection(i, &featuresTrain)->apply(featuresTrain);
+    }
+    
+    // The random number generator of OpenCV is per thread: start each model from the same state,
+    // so a model does not depend on which thread trains it or on the models trained before it
+    theRNG() = RNG();
+    
+    
+    if (modelTypes[i] == "svm")
+    {
+        // Place into trainData
+        Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, classesTrain);
+
+        // Create new SVM
+        Ptr<SVM> svmGauss = SVM::create();
+
+        // Set parameters
+        svmGauss->setType(SVM::C_SVC);
+        svmGauss->setKernel(SVM::RBF);
+
+
+        // Train model and save
+        if (svmTuning == "shared")
+        {
+            trainAuto_svm(trainingData, svmGauss, generateFilename(i));
+        }
+        else
         {
-            outputFeatures.at<float>(i, j) = (float)histogram[j];
+            svmGauss->trainAuto(trainingData);
         }
         
+        svmGauss->save(modelOutputDir + generateFilename(i));
+    }
+    else if (modelTypes[i] == "rf")
+    {
+        // Place into trainData
+        Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, classesTrain);
+
+        // Create new Random Forest
+        Ptr<RTrees> rForest = RTrees::create();
         
-        // Normalize
-        cv::Scalar mean;
-        cv::Scalar stddev;
+        // Train model and save
+        trainAuto_rf(trainingData, rForest, generateFilename(i));
         
-        meanStdDev(outputFeatures.row(i), mean, stddev);
+        rForest->save(modelOutputDir + generateFilename(i));
         
-        for (int j = 0; j < (int)(histogram).size(); j++)
+        
+    }
+    else if (modelTypes[i] == "mp")
+    {
+        // Place into trainData (need two responses (.8,-.8) and (-.8,.8))
+        cv::Mat nnResponses(classesTrain.rows, 2, CV_32FC1);
+
+        for (int i = 0; i < classesTrain.rows; i++)
         {
-            outputFeatures.at<float>(i, (j)) = (outputFeatures.at<float>(i, j) - mean[0]) / stddev[0];
+            if (classesTrain.at<int>(i,0) == 1)
+            {
+                // Textured
+                nnResponses.at<float>(i,0) = 0.8;
+                nnResponses.at<float>(i,1) = -0.8;
+            }
+            else if (classesTrain.at<int>(i,0) == 0)
+            {
+                // Clear or none
+                nnResponses.at<float>(i,0) = -0.8;
+                nnResponses.at<float>(i,1) = 0.8;
+            }
         }
+        Ptr<TrainData> trainingData = TrainData::create(featuresTrain, ROW_SAMPLE, nnResponses);
         
         
-        // Load class into Mat
-        // don't load labels for the test set if it doesn't have any
-        if (hasBaseTruth || (setType == TRAIN)) {
-            outputLabels.at<int>(i,0) = (*classSet)[i];
+
+        // Train MLP and save
+        
+        Ptr<ANN_MLP> autoMLP = ANN_MLP::create();
+        trainAuto_mlp(trainingData, autoMLP, generateFilename(i));
+        autoMLP->save(modelOutputDir + generateFilename(i));
+        
+    }
+}
+
+
+// Starts a task of a parameter search from a random state of its own (task -1: the final model), so searches give
+// the same results whatever the number of threads and whichever thread runs each task
+static void seedSearchTask(int task)
+{
+    theRNG() = RNG((uint64)0xffffffff + (uint64)(task + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+// Splits the samples into k folds at random, with the negative and positive samples divided evenly between the folds
+static void stratifiedFolds(const vector<bool>& negative, int k_folds, vector<vector<int>>& k_idx)
+{
+    int sample_count = (int)negative.size();
+    
+    vector<int> sidx;
+    setRangeVector(sidx, sample_count);
+    RNG rng = RNG();
+    
+    // randomly permute training samples
+    for( int i = 0; i < sample_count; i++ )
+    {
+        int i1 = rng.uniform(0, sample_count);
+        int i2 = rng.uniform(0, sample_count);
+        std::swap(sidx[i1], sidx[i2]);
+    }
+    
+    // reshuffle the training set in such a way that
+    // instances of each class are divided more or less evenly
+    // between the k_fold parts.
+    vector<int> sidx0, sidx1;
+    
+    // separate pos and neg samples
+    for( int i = 0; i < sample_count; i++ )
+    {
+        if( negative[sidx[i]] )
+        {
+            sidx0.push_back(sidx[i]);
+        }
+        else
+        {
+           sidx1.push_back(sidx[i]);
+        }
+    }
+    
+    int n0 = (int)sidx0.size(), n1 = (int)sidx1.size();
+    int a0 = 0, a1 = 0;
+    k_idx.clear();
+    
+    for( int k = 0; k < k_folds; k++ )
+    {
+        sidx.clear();
+        int b0 = ((k+1)*n0 + k_folds/2)/k_folds, b1 = ((k+1)*n1 + k_folds/2)/k_folds;
+        int a = (int)sidx.size(), b = a + (b0 - a0) + (b1 - a1); // b gives end position of samples
+        // a0 is startpoint and b0 is endpoint
+        for( int i = a0; i < b0; i++ )
+            sidx.push_back(sidx0[i]);
+        for( int i = a1; i < b1; i++ )
+            sidx.push_back(sidx1[i]);
+        for( int i = 0; i < (b - a); i++ ) // for the number of samples
+        {
+            int i1 = rng.uniform(a, b); // swap samples between a and b (the ones that have been added this cycle)
+            int i2 = rng.uniform(a, b);
+            std::swap(sidx[i1], sidx[i2]);
         }
+        // start at previous ending positions
+        a0 = b0; a1 = b1;
+        // add k set to vector
+        k_idx.push_back(sidx);
+    }
+}
 
+
+// Cross-validation folds as views: the samples and responses laid out once in fold order, so that the testing set of fold k
+// is one range of rows and its training set (all the other folds, in fold order, as a serial search takes them) is a list of
+// rows of the same layout. Built once per search and shared, read-only, by all its tasks, instead of copying the folds for
+// every grid point
+struct foldViews
+{
+    cv::Mat samples;
+    cv::Mat responses;
+    std::vector<int> start;
+    
+    int count(void) const { return (int)start.size() - 1; }
+    int total(void) const { return start.back(); }
+    
+    // Rows of the training set of fold k (folds 0 to k-1, then k+1 onwards), for TrainData to read through without copying
+    cv::Mat trainIdx(int k) const
+    {
+        cv::Mat idx(1, total() - (start[k + 1] - start[k]), CV_32SC1);
+        int n = 0;
+        for (int row = 0; row < total(); row++)
+        {
+            if ((row < start[k]) || (row >= start[k + 1]))
+            {
+                idx.at<int>(0, n++) = row;
+            }
+        }
+        return idx;
+    }
+    
+    // The training set of fold k, copied in the same order (for models that train on a matrix of their own anyway)
+    void trainSet(int k, cv::Mat& trainSamples, cv::Mat& trainResponses) const
+    {
+        int before = start[k], after = total() - start[k + 1];
+        trainSamples.create(before + after, samples.cols, samples.type());
+        trainResponses.create(before + after, responses.cols, responses.type());
+        if (before > 0)
+        {
+            samples.rowRange(0, before).copyTo(trainSamples.rowRange(0, before));
+            responses.rowRange(0, before).copyTo(trainResponses.rowRange(0, before));
+        }
+        if (after > 0)
+        {
+            samples.rowRange(start[k + 1], total()).copyTo(trainSamples.rowRange(before, before + after));
+            responses.rowRange(start[k + 1], total()).copyTo(trainResponses.rowRange(before, before + after));
+        }
+    }
+    
+    cv::Mat testSamples(int k) const { return samples.rowRange(start[k], start[k + 1]); }
+    cv::Mat testResponses(int k) const { return responses.rowRange(start[k], start[k + 1]); }
+};
+
+// Lays out the samples of each fold (given by their indices) for the views
+static void buildFoldViews(const Mat& samples, const Mat& responses, const vector<vector<int>>& k_idx, foldViews& folds)
+{
+    int total = 0;
+    folds.start.assign(1, 0);
+    for (int k = 0; k < (int)k_idx.size(); k++)
+    {
+        total += (int)k_idx[k].size();
+        folds.start.push_back(total);
+    }
+    
+    folds.samples.create(total, samples.cols, samples.type());
+    folds.responses.create(total, responses.cols, responses.type());
+    int row = 0;
+    for (int k = 0; k < (int)k_idx.size(); k++)
+    {
+        for (int sample_num = 0; sample_num < (int)k_idx[k].size(); sample_num++)
+        {
+            samples.row(k_idx[k][sample_num]).copyTo(folds.samples.row(row));
+            responses.row(k_idx[k][sample_num]).copyTo(folds.responses.row(row));
+            row++;
+        }
+    }
+}
+
+// RBF kernel over precomputed squared distances. The samples given to the SVM are indices into the training set (one column),
+// so every kernel value is read from the distance matrix shared by all candidates and folds instead of computed from the features
+class distanceKernel : public SVM::Kernel
+{
+public:
+    distanceKernel(const Mat& squaredDistances, double kernelGamma) : distances(squaredDistances), gamma(kernelGamma) {}
+    
+    int getType(void) const { return SVM::CUSTOM; }
+    
+    void calc(int vcount, int n, const float* vecs, const float* another, float* results)
+    {
+        const float* row = distances.ptr<float>((int)another[0]);
+        for (int j = 0; j < vcount; j++)
+        {
+            results[j] = (float)std::exp(-gamma * row[(int)vecs[j * n]]);
+        }
+    }
+    
+private:
+    Mat distances;
+    double gamma;
+};
+
+// Trains an RBF SVM on all folds but k and returns its accuracy on fold k (one task of the parameter search)
+// The folds hold sample indices, and kernel values come from the squared distances between samples
+static float svmFoldCCR(const foldViews& folds, int k, const Mat& squaredDistances, double C, double gamma)
+{
+    // Place folds minus k into trainData (read through their rows of the layout)
+    Ptr<TrainData> trainingData = TrainData::create(folds.samples, ROW_SAMPLE, folds.responses, noArray(), folds.trainIdx(k));
+    
+    // Create SVM over the shared distances
+    Ptr<SVM> svm_tmp = SVM::create();
+    svm_tmp->setType(SVM::C_SVC);
+    svm_tmp->setC(C);
+    svm_tmp->setCustomKernel(makePtr<distanceKernel>(squaredDistances, gamma));
+    
+    // Train SVM
+    svm_tmp->train(trainingData);
+    
+    // Test model on the final fold
+    cv::Mat test_classes = folds.testResponses(k);
+    cv::Mat predictions(test_classes.rows, test_classes.cols, CV_32FC1); // new mat for results
+    svm_tmp->predict(folds.testSamples(k), predictions);
+    // Determine number incorrect
+    int numIncorrect = 0;
+    for (int pnum = 0; pnum < test_classes.rows; pnum++)
+    {
+        if (predictions.at<float>(pnum,0) != test_classes.at<int>(pnum,0))
+        {
+            numIncorrect++;
+        }
+    }
+    
+    // Output accuracy
+    return 100 - ((float)numIncorrect / test_classes.rows) * 100;
+}
+
+// Trains a random forest on all folds but k and returns its accuracy on fold k (one task of the parameter search)
+static float rfFoldCCR(const foldViews& folds, int k, int depth, int minSampleCount)
+{
+    // Place folds minus k into trainData (read through their rows of the layout)
+    Ptr<TrainData> trainingData = TrainData::create(folds.samples, ROW_SAMPLE, folds.responses, noArray(), folds.trainIdx(k));
+    
+    // Create new Random Forest
+    Ptr<RTrees> rForest_tmp = RTrees::create();
+    rForest_tmp->setMaxDepth(depth);
+    rForest_tmp->setMinSampleCount(minSampleCount);
+    
+    // Train model
+    rForest_tmp->train(trainingData);
+    
+    // Test model on the final fold
+    cv::Mat test_classes = folds.testResponses(k);
+    cv::Mat predictions(test_classes.rows, test_classes.cols, CV_32FC1); // new mat for results
+    rForest_tmp->predict(folds.testSamples(k), predictions);
+    // Determine number incorrect
+    int numIncorrect = 0;
+    for (int pnum = 0; pnum < test_classes.rows; pnum++)
+    {
+        if (predictions.at<float>(pnum,0) != test_classes.at<int>(pnum,0))
+        {
+            numIncorrect++;
+        }
+    }
+
+    // Output accuracy
+    return 100 - ((float)numIncorrect / test_classes.rows) * 100;
+}
+
+// Trains a multilayer perceptron on all folds but k and returns its accuracy on fold k (one task of the parameter search)
+// The training set of fold k is given as matrices, built once per fold and shared by all hidden layer sizes
+static float mlpFoldCCR(const foldViews& folds, int k, const Mat& trainSamples, const Mat& trainResponses, int multiplier)
+{
+    // Place folds minus k into trainData
+    Ptr<TrainData> trainingData = TrainData::create(trainSamples, ROW_SAMPLE, trainResponses);
+    
+    // Define multilayer perceptron parameters
+    cv::Mat layerSize(3, 1, CV_32SC1);
+    layerSize.at<int>(0,0) = folds.samples.cols;
+    layerSize.at<int>(1,0) = folds.samples.cols * multiplier;
+    layerSize.at<int>(2,0) = folds.responses.cols;
+    
+    // Create MLP
+    Ptr<ANN_MLP> tmp_MLP = ANN_MLP::create();
+    tmp_MLP->setLayerSizes(layerSize);
+    tmp_MLP->setTrainMethod(ANN_MLP::BACKPROP);
+    tmp_MLP->setActivationFunction(ANN_MLP::SIGMOID_SYM,1,1);
+    
+    // Train MLP
+    tmp_MLP->train(trainingData);
+    
+    // Test model on the final fold
+    cv::Mat test_classes = folds.testResponses(k);
+    cv::Mat predictions(test_classes.rows, test_classes.cols, CV_32FC1); // new mat for results
+    tmp_MLP->predict(folds.testSamples(k), predictions);
+    
+    // Determine number incorrect
+    int numIncorrect = 0;
+    for (int pnum = 0; pnum < test_classes.rows; pnum++)
+    {
+        if ((predictions.at<float>(pnum,0) > 0.8) && (predictions.at<float>(pnum,1) < -0.8))
+        {
+            // Falsely identified as textured
+            if (test_classes.at<float>(pnum,0) == -0.8)
+            {
+               numIncorrect++;
+            }
+        }
+        else if ((predictions.at<float>(pnum,0) < -0.8) && (predictions.at<float>(pnum,1) > 0.8))
+        {
+            // Falsely identified as not textured
+            if (test_classes.at<float>(pnum,0) == 0.8)
+            {
+                numIncorrect++;
+            }
+        }
+        else
+        {
+            // no prediction
+            numIncorrect++;
+        }
+    }
+    
+    // Output accuracy
+    return 100 - ((float)numIncorrect / test_classes.rows) * 100;
+}
+
+// Cross-validates the candidates of a parameter search and returns the best one (-1 if none is better than 0% accuracy)
+// Grid: every candidate on every fold. Halving: every candidate on the first folds, then the best 1 / rate of them on rate
+// times as many folds, and so on up to all folds. Either way a (candidate, fold) task always gets the same random state and
+// score, and the best candidate is picked in candidate order on the folds evaluated, as a serial search would
+int TCLManager::searchParameters(const std::string& modelName, const std::vector<std::string>& candidates, const std::vector<double>& costs, int k_folds, const std::function<float(int, int)>& foldCCR)
+{
+    int numPoints = (int)candidates.size();
+    vector<float> ccr(numPoints * k_folds);
+    vector<int> alive;
+    setRangeVector(alive, numPoints);
+    
+    int folds = (parameterSearch == "halving") ? std::min(halvingFirstFolds, k_folds) : k_folds;
+    int evaluated = 0;
+    for (int rung = 1; ; rung++)
+    {
+        // Evaluate the candidates still in the search on the folds they have not been evaluated on yet
+        taskScheduler search(searchThreads);
+        for (int c = 0; c < (int)alive.size(); c++)
+        {
+            int point = alive[c];
+            for (int k = evaluated; k < folds; k++)
+            {
+                search.add(costs[point], [&, point, k]()
+                {
+                    seedSearchTask(point * k_folds + k);
+                    ccr[point * k_folds + k] = foldCCR(point, k);
+                });
+            }
+        }
+        search.run();
+        evaluated = folds;
+        
+        if ((evaluated == k_folds) || (alive.size() == 1))
+        {
+            break;
+        }
+        
+        // Promote the best 1 / rate of the candidates (candidate order breaks ties)
+        vector<float> mean(numPoints);
+        for (int c = 0; c < (int)alive.size(); c++)
+        {
+            float total = 0;
+            for (int k = 0; k < evaluated; k++)
+            {
+                total += ccr[alive[c] * k_folds + k];
+            }
+            mean[alive[c]] = total / (float)evaluated;
+        }
+        std::stable_sort(alive.begin(), alive.end(), [&](int a, int b) { return mean[a] > mean[b]; });
+        int promoted = std::max(1, ((int)alive.size() + halvingRate - 1) / halvingRate);
+        folds = std::min(k_folds, folds * halvingRate);
+        
+        std::ostringstream line;
+        line << modelName << " | rung " << rung << ": " << alive.size() << " candidates on " << evaluated << " folds, " << promoted << " promoted to " << folds << " folds:";
+        for (int c = 0; c < promoted; c++)
+        {
+            line << " [" << candidates[alive[c]] << ": " << mean[alive[c]] << "%]";
+        }
+        logSearch(line.str());
+        
+        alive.resize(promoted);
+        std::sort(alive.begin(), alive.end());
+    }
+    
+    // determine average performance over folds and check if it is better than other candidates
+    int best = -1;
+    float best_ccr = 0.0;
+    for (int c = 0; c < (int)alive.size(); c++)
+    {
+        float total = 0;
+        for (int k = 0; k < evaluated; k++)
+        {
+            total += ccr[alive[c] * k_folds + k];
+        }
+        float mean_performance = total / (float)evaluated;
+        
+        if (mean_performance > best_ccr)
+        {
+            best_ccr = mean_performance;
+            best = alive[c];
+        }
+    }
+    
+    if ((parameterSearch == "halving") && (best >= 0))
+    {
+        std::ostringstream line;
+        line << modelName << " | selected " << candidates[best] << ": " << best_ccr << "% on " << evaluated << " folds";
+        logSearch(line.str());
     }
     
-    // Close file
-    status = H5Fclose(file_id);
+    return best;
+}
+
 
+// Records a line of the parameter search log: appended to the search log file if one is set, otherwise shown
+void TCLManager::logSearch(const std::string& line)
+{
+    std::lock_guard<std::mutex> guard(trainingLock);
+    if (searchLogFilename == "")
+    {
+        cout << "  " << line << endl;
+        return;
+    }
+    
+    ofstream log(searchLogFilename, ios::app);
+    if (! log.good())
+    {
+        throw runtime_error("Error: cannot write to the search log " + searchLogFilename);
+    }
+    log << line << endl;
 }
 
 
-// finds the best parameters for a random forest model
-void TCLManager::trainAuto_rf(Ptr<TrainData>& data, Ptr<RTrees> model)
+// finds the best C and gamma for an RBF SVM, on the grids of SVM::trainAuto, by cross-validation on a kernel shared by all
+// candidates: the squared distances between training samples are computed once, and every (C, gamma, fold) training reads its
+// kernel values from them. The final model is an ordinary RBF SVM trained on the features, so it saves and loads as before
+void TCLManager::trainAuto_svm(Ptr<TrainData>& data, Ptr<SVM>& model, const std::string& modelName)
 {
     // Define parameters
     int k_folds = 10;
     
-    // 10 folds times 20 trials = 200 total training cycles
-    vector<int> training_depth = {1, 5, 10, 15, 20, 25};
-    vector<float> percent_of_traindata = {1, 1.5, 2, 2.5};
+    // Default grids of SVM::trainAuto: 6 values of C times 5 values of gamma
+    vector<double> C_values, gamma_values;
+    ParamGrid C_grid = SVM::getDefaultGrid(SVM::C);
+    ParamGrid gamma_grid = SVM::getDefaultGrid(SVM::GAMMA);
+    for (double C = C_grid.minVal; C < C_grid.maxVal; C *= C_grid.logStep)
+    {
+        C_values.push_back(C);
+    }
+    for (double gamma = gamma_grid.minVal; gamma < gamma_grid.maxVal; gamma *= gamma_grid.logStep)
+    {
+        gamma_values.push_back(gamma);
+    }
     
     // get training data
     Mat samples = data->getTrainSamples();
     Mat responses = data->getTrainResponses();
-    //cout << responses << endl;
     int sample_count = samples.rows;
     
-    vector<int> sidx;
-    setRangeVector(sidx, sample_count);
-    RNG rng = RNG();
-    
-    // randomly permute training samples
+    // split into k folds (class 0 negative)
+    vector<bool> negative(sample_count);
     for( int i = 0; i < sample_count; i++ )
     {
-        int i1 = rng.uniform(0, sample_count);
-        int i2 = rng.uniform(0, sample_count);
-        std::swap(sidx[i1], sidx[i2]);
+        negative[i] = (responses.at<int>(i,0) == 0);
     }
+    vector<vector<int>> k_idx;
+    stratifiedFolds(negative, k_folds, k_idx);
     
-    // reshuffle the training set in such a way that
-    // instances of each class are divided more or less evenly
-    // between the k_fold parts.
-    vector<int> sidx0, sidx1;
+    // squared distances between all training samples, once for all candidates
+    Mat squaredDistances;
+    batchDistance(samples, samples, squaredDistances, CV_32F, noArray(), NORM_L2SQR);
     
-    // separate pos and neg samples
-    for( int i = 0; i < sample_count; i++ )
+    // the folds of the search hold sample indices
+    Mat indices(sample_count, 1, CV_32FC1);
+    for (int i = 0; i < sample_count; i++)
     {
-        if( responses.at<int>(sidx[i],0) == 0 )
-        {
-            sidx0.push_back(sidx[i]);
-        }
-        else
+        indices.at<float>(i,0) = (float)i;
+    }
+    foldViews folds;
+    buildFoldViews(indices, responses, k_idx, folds);
+    
+    // Every (C, gamma, fold) training is an independent task
+    int num_gammas = (int)gamma_values.size();
+    vector<std::string> candidates;
+    vector<double> costs;
+    for (int i = 0; i < (int)C_values.size(); i++)
+    {
+        for (int j = 0; j < num_gammas; j++)
         {
-           sidx1.push_back(sidx[i]);
+            std::ostringstream candidate;
+            candidate << "C " << C_values[i] << ", gamma " << gamma_values[j];
+            candidates.push_back(candidate.str());
+            
+            // Larger C takes more iterations to converge: start them first
+            costs.push_back(i);
         }
     }
+    int best = searchParameters(modelName, candidates, costs, k_folds, [&](int point, int k)
+    {
+        return svmFoldCCR(folds, k, squaredDistances, C_values[point / num_gammas], gamma_values[point % num_gammas]);
+    });
     
-    int n0 = (int)sidx0.size(), n1 = (int)sidx1.size();
-    int a0 = 0, a1 = 0;
-    vector<vector<int>> k_idx;
+    // train with best parameters (the first candidate if none classifies anything correctly)
+    best = std::max(best, 0);
+    model->setType(SVM::C_SVC);
+    model->setKernel(SVM::RBF);
+    model->setC(C_values[best / num_gammas]);
+    model->setGamma(gamma_values[best % num_gammas]);
     
-    for( int k = 0; k < k_folds; k++ )
+    model->train(data);
+}
+
+
+// Out-of-bag error of a trained random forest (the fraction of training samples misclassified by the trees not trained on them)
+// OpenCV 3 computes it while training (its default termination criteria include EPS) but only exposes it in the saved model
+static double forestOOBError(const Ptr<RTrees>& forest)
+{
+#if CV_VERSION_MAJOR >= 4
+    return forest->getOOBError();
+#else
+    FileStorage saved(".xml", FileStorage::WRITE + FileStorage::MEMORY);
+    forest->write(saved);
+    FileStorage stored(saved.releaseAndGetString(), FileStorage::READ + FileStorage::MEMORY);
+    return (double)stored["oob_error"];
+#endif
+}
+
+
+// finds the best parameters for a random forest model by out-of-bag error: each candidate forest is trained once on the whole
+// training set, and the forest with the lowest out-of-bag error is kept as the model (no cross-validation, no retraining)
+void TCLManager::trainOOB_rf(Ptr<TrainData>& data, Ptr<RTrees>& model, const std::string& modelName)
+{
+    // Same candidates as the cross-validated search
+    vector<int> training_depth = {1, 5, 10, 15, 20, 25};
+    vector<float> percent_of_traindata = {1, 1.5, 2, 2.5};
+    int num_counts = (int)percent_of_traindata.size();
+    int numPoints = (int)training_depth.size() * num_counts;
+    
+    Mat samples = data->getTrainSamples();
+    Mat responses = data->getTrainResponses();
+    int sample_count = samples.rows;
+    
+    // Every candidate is an independent task with its own random state (each with its own TrainData over the shared matrices)
+    vector<Ptr<RTrees>> forests(numPoints);
+    vector<double> oobError(numPoints);
+    taskScheduler search(searchThreads);
+    for (int point = 0; point < numPoints; point++)
     {
-        sidx.clear();
-        int b0 = ((k+1)*n0 + k_folds/2)/k_folds, b1 = ((k+1)*n1 + k_folds/2)/k_folds;
-        int a = (int)sidx.size(), b = a + (b0 - a0) + (b1 - a1); // b gives end position of samples
-        // a0 is startpoint and b0 is endpoint
-        for( int i = a0; i < b0; i++ )
-            sidx.push_back(sidx0[i]);
-        for( int i = a1; i < b1; i++ )
-            sidx.push_back(sidx1[i]);
-        for( int i = 0; i < (b - a); i++ ) // for the number of samples
+        int i = point / num_counts, j = point % num_counts;
+        
+        // Deeper trees take longer to train: start them first
+        search.add(training_depth[i], [&, point, i, j]()
         {
-            int i1 = rng.uniform(a, b); // swap samples between a and b (the ones that have been added this cycle)
-            int i2 = rng.uniform(a, b);
-            std::swap(sidx[i1], sidx[i2]);
+            seedSearchTask(point);
+            Ptr<TrainData> trainingData = TrainData::create(samples, ROW_SAMPLE, responses);
+            Ptr<RTrees> forest = RTrees::create();
+            forest->setMaxDepth(training_depth[i]);
+            forest->setMinSampleCount((int)(sample_count * percent_of_traindata[j] / 100));
+            forest->train(trainingData);
+            oobError[point] = forestOOBError(forest);
+            forests[point] = forest;
+        });
+    }
+    search.run();
+    
+    // Lowest out-of-bag error, candidate order breaking ties
+    int best = 0;
+    std::ostringstream line;
+    line << modelName << " | out-of-bag errors:";
+    for (int point = 0; point < numPoints; point++)
+    {
+        if (oobError[point] < oobError[best])
+        {
+            best = point;
         }
-        // start at previous ending positions
-        a0 = b0; a1 = b1;
-        // add k set to vector
-        k_idx.push_back(sidx);
+        line << " [depth " << training_depth[point / num_counts] << ", min samples " << percent_of_traindata[point % num_counts] << "%: " << oobError[point] << "]";
+    }
+    logSearch(line.str());
+    
+    std::ostringstream selected;
+    selected << modelName << " | selected depth " << training_depth[best / num_counts] << ", min samples " << percent_of_traindata[best % num_counts] << "% (out-of-bag error " << oobError[best] << ")";
+    logSearch(selected.str());
+    
+    model = forests[best];
+}
+
+
+// finds the best parameters for a random forest model
+void TCLManager::trainAuto_rf(Ptr<TrainData>& data, Ptr<RTrees>& model, const std::string& modelName)
+{
+    if (forestTuning == "oob")
+    {
+        trainOOB_rf(data, model, modelName);
+        return;
+    }
+    
+    // Define parameters
+    int k_folds = 10;
+    
+    // 10 folds times 20 trials = 200 total training cycles
+    vector<int> training_depth = {1, 5, 10, 15, 20, 25};
+    vector<float> percent_of_traindata = {1, 1.5, 2, 2.5};
+    
+    // get training data
+    Mat samples = data->getTrainSamples();
+    Mat responses = data->getTrainResponses();
+    //cout << responses << endl;
+    int sample_count = samples.rows;
+    
+    // split into k folds (class 0 negative)
+    vector<bool> negative(sample_count);
+    for( int i = 0; i < sample_count; i++ )
+    {
+        negative[i] = (responses.at<int>(i,0) == 0);
     }
+    vector<vector<int>> k_idx;
+    stratifiedFolds(negative, k_folds, k_idx);
     
-    // calculate number of samples per fold
-    int number_per_fold = ((n0 + k_folds/2)/k_folds + (n1 + k_folds/2)/k_folds);
+    // lay out the folds once for all grid points
+    foldViews folds;
+    buildFoldViews(samples, responses, k_idx, folds);
     
     // testing parameters
     int best_depth = 0;
     int best_count = 0;
-    float best_ccr = 0.0;
     
+    // Every (depth, min_sample_count, fold) training is an independent task, each with its own random state
+    int num_counts = (int)percent_of_traindata.size();
+    vector<std::string> candidates;
+    vector<double> costs;
     for (int i = 0; i < (int)training_depth.size(); i++) // all training depths
     {
-        for (int j = 0; j < (int)percent_of_traindata.size(); j++) // all min_sample_count
+        for (int j = 0; j < num_counts; j++) // all min_sample_count
         {
-            // create vector to track performance over all folds
-            vector<float> ccr;
-            
-            // Loop through 10 folds
-            for (int k = 0; k < k_folds; k++)
-            {
-                // load folds minus k
-                Mat train_samples(((k_folds - 1)* number_per_fold), samples.cols, CV_32FC1);
-                Mat train_classes(((k_folds - 1)* number_per_fold), responses.cols, CV_32SC1);
-                int samples_added = 0;
-                for (int l = 0; l < k_folds; l++)
-                {
-                    if (l != k) // skip current fold to use for testing
-                    {
-                        // load indices for the current fold
-                        vector<int> current_fold = k_idx[l];
-                        // add samples to mat objects
-                        for (int sample_num = 0; sample_num < (int)current_fold.size(); sample_num++)
-                        {
-                            samples.row(current_fold[sample_num]).copyTo(train_samples.row(samples_added));
-                            train_classes.at<int>(samples_added,0) = responses.at<int>(current_fold[sample_num],0);
-                            samples_added++;
-                        }
-                    }
-                }
-                
-                // Place into trainData
-                Ptr<TrainData> trainingData = TrainData::create(train_samples, ROW_SAMPLE, train_classes);
-                
-                // Create new Random Forest
-                Ptr<RTrees> rForest_tmp = RTrees::create();
-                rForest_tmp->setMaxDepth(training_depth[i]);
-                rForest_tmp->setMinSampleCount((int)(sample_count * percent_of_traindata[j] / 100));
-                
-                // Train model and save
-                rForest_tmp->train(trainingData);
-                
-                // Load final fold to test
-                vector<int> final_fold = k_idx[k];
-                Mat test_samples(number_per_fold, samples.cols, CV_32FC1);
-                Mat test_classes(number_per_fold, responses.cols, CV_32SC1);
-                // add samples to mat objects
-                for (int sample_num = 0; sample_num < (int)final_fold.size(); sample_num++)
-                {
-                    samples.row(final_fold[sample_num]).copyTo(test_samples.row(sample_num));
-                    test_classes.at<int>(sample_num,0) = responses.at<int>(final_fold[sample_num],0);
-                    samples_added++;
-                }
-                
-                // Test model
-                cv::Mat predictions(test_classes.rows, test_classes.cols, CV_32FC1); // new mat for results
-                rForest_tmp->predict(test_samples, predictions);
-                // Determine number incorrect
-                int numIncorrect = 0;
-                for (int pnum = 0; pnum < test_classes.rows; pnum++)
-                {
-                    if (predictions.at<float>(pnum,0) != test_classes.at<int>(pnum,0))
-                    {
-                        numIncorrect++;
-                    }
-                }
+            std::ostringstream candidate;
+            candidate << "depth " << training_depth[i] << ", min samples " << percent_of_traindata[j] << "%";
+            candidates.push_back(candidate.str());
             
-                // Output accuracy
-                float ccr_single = 100 - ((float)numIncorrect / test_classes.rows) * 100;
-                
-                ccr.push_back(ccr_single);
-            }
-            // determine average performance over folds
-            float total = 0;
-            for (int k = 0; k < (int)ccr.size(); k++)
-            {
-                total += ccr[k];
-            }
-            float mean_performance = total / (float)ccr.size();
-            
-            // check if this is better than other models
-            if (mean_performance > best_ccr)
-            {
-                best_ccr = mean_performance;
-                best_depth = training_depth[i];
-                best_count = percent_of_traindata[j];
-            }
+            // Deeper trees take longer to train: start them first
+            costs.push_back(training_depth[i]);
         }
     }
+    int best = searchParameters(modelName, candidates, costs, k_folds, [&](int point, int k)
+    {
+        int i = point / num_counts, j = point % num_counts;
+        return rfFoldCCR(folds, k, training_depth[i], (int)(sample_count * percent_of_traindata[j] / 100));
+    });
+    if (best >= 0)
+    {
+        best_depth = training_depth[best / num_counts];
+        best_count = percent_of_traindata[best % num_counts];
+    }
     
-    // train with best parameters
+    // train with best parameters (from the same random state whatever tasks ran on this thread)
+    seedSearchTask(-1);
     model->setMaxDepth(best_depth);
     model->setMinSampleCount((int)(sample_count * best_count / 100));
     
@@ -992,7 +1993,7 @@ void TCLManager::trainAuto_rf(Ptr<TrainData>& data, Ptr<RTrees> model)
 }
 
 // finds the best parameters for a multilayer perceptron model
-void TCLManager::trainAuto_mlp(Ptr<TrainData>& data, Ptr<ANN_MLP> model)
+void TCLManager::trainAuto_mlp(Ptr<TrainData>& data, Ptr<ANN_MLP> model, const std::string& modelName)
 {
     // Define parameters
     int k_folds = 10;
@@ -1007,182 +2008,46 @@ void TCLManager::trainAuto_mlp(Ptr<TrainData>& data, Ptr<ANN_MLP> model)
     /* CREATE K-FOLDS */
     int sample_count = samples.rows;
     
-    vector<int> sidx;
-    setRangeVector(sidx, sample_count);
-    RNG rng = RNG();
-    
-    // randomly permute training samples
-    for( int i = 0; i < sample_count; i++ )
-    {
-        int i1 = rng.uniform(0, sample_count);
-        int i2 = rng.uniform(0, sample_count);
-        std::swap(sidx[i1], sidx[i2]);
-    }
-    
-    // reshuffle the training set in such a way that
-    // instances of each class are divided more or less evenly
-    // between the k_fold parts.
-    vector<int> sidx0, sidx1;
-    
-    // separate pos and neg samples
+    // split into k folds (0 for MLP is -0.8 and 0.8)
+    vector<bool> negative(sample_count);
     for( int i = 0; i < sample_count; i++ )
     {
-        // 0 for MLP is -0.8 and 0.8
-        if((responses.at<float>(sidx[i],0)) == -0.8 && (responses.at<float>(sidx[i],1) == 0.8))
-        {
-            sidx0.push_back(sidx[i]);
-        }
-        else // must be a 1
-        {
-           sidx1.push_back(sidx[i]);
-        }
+        negative[i] = ((responses.at<float>(i,0)) == -0.8 && (responses.at<float>(i,1) == 0.8));
     }
-    
-    int n0 = (int)sidx0.size(), n1 = (int)sidx1.size();
-    int a0 = 0, a1 = 0;
     vector<vector<int>> k_idx;
+    stratifiedFolds(negative, k_folds, k_idx);
     
-    for( int k = 0; k < k_folds; k++ )
+    // lay out the folds once for all hidden layer sizes, and copy the training set of each fold once, in fold order
+    // (backpropagation visits the samples in the order given)
+    foldViews folds;
+    buildFoldViews(samples, responses, k_idx, folds);
+    vector<Mat> foldSamples(k_folds), foldResponses(k_folds);
+    for (int k = 0; k < k_folds; k++)
     {
-        sidx.clear();
-        int b0 = ((k+1)*n0 + k_folds/2)/k_folds, b1 = ((k+1)*n1 + k_folds/2)/k_folds;
-        int a = (int)sidx.size(), b = a + (b0 - a0) + (b1 - a1); // b gives end position of samples
-        // a0 is startpoint and b0 is endpoint
-        for( int i = a0; i < b0; i++ )
-            sidx.push_back(sidx0[i]);
-        for( int i = a1; i < b1; i++ )
-            sidx.push_back(sidx1[i]);
-        for( int i = 0; i < (b - a); i++ ) // for the number of samples
-        {
-            int i1 = rng.uniform(a, b); // swap samples between a and b (the ones that have been added this cycle)
-            int i2 = rng.uniform(a, b);
-            std::swap(sidx[i1], sidx[i2]);
-        }
-        // start at previous ending positions
-        a0 = b0; a1 = b1;
-        // add k set to vector
-        k_idx.push_back(sidx);
+        folds.trainSet(k, foldSamples[k], foldResponses[k]);
     }
     
-    // calculate number of samples per fold
-    int number_per_fold = ((n0 + k_folds/2)/k_folds + (n1 + k_folds/2)/k_folds);
-    
     // testing parameters
     int best_multiplier = 0;
-    float best_ccr = 0.0;
     
     /* PERFORM K-FOLD ANALYSIS */
+    // Every (hidden layer size, fold) training is an independent task, each with its own random state
+    vector<std::string> candidates;
+    vector<double> costs;
     for (int i = 0; i < (int)hidden_layer_multiplier.size(); i++) // all hidden layer sizes
     {
+        candidates.push_back("hidden layer " + std::to_string(hidden_layer_multiplier[i]) + "x");
         
-        // create vector to track performance over all folds
-        vector<float> ccr;
-        
-        // Loop through 10 folds
-        for (int k = 0; k < k_folds; k++)
-        {
-            // load folds minus k
-            Mat train_samples(((k_folds - 1)* number_per_fold), samples.cols, CV_32FC1);
-            Mat train_classes(((k_folds - 1)* number_per_fold), responses.cols, CV_32FC1);
-            int samples_added = 0;
-            for (int l = 0; l < k_folds; l++)
-            {
-                if (l != k) // skip current fold to use for testing
-                {
-                    // load indices for the current fold
-                    vector<int> current_fold = k_idx[l];
-                    // add samples to mat objects
-                    for (int sample_num = 0; sample_num < (int)current_fold.size(); sample_num++)
-                    {
-                        samples.row(current_fold[sample_num]).copyTo(train_samples.row(samples_added));
-                        train_classes.at<float>(samples_added,0) = responses.at<float>(current_fold[sample_num],0);
-                        train_classes.at<float>(samples_added,1) = responses.at<float>(current_fold[sample_num],1);
-                        samples_added++;
-                    }
-                }
-            }
-            
-            // Place into trainData
-            Ptr<TrainData> trainingData = TrainData::create(train_samples, ROW_SAMPLE, train_classes);
-            
-            // Define multilayer perceptron parameters
-            cv::Mat layerSize(3, 1, CV_32SC1);
-            layerSize.at<int>(0,0) = train_samples.cols;
-            layerSize.at<int>(1,0) = train_samples.cols * hidden_layer_multiplier[i];
-            layerSize.at<int>(2,0) = train_classes.cols;
-            
-            // Create MLP
-            Ptr<ANN_MLP> tmp_MLP = ANN_MLP::create();
-            tmp_MLP->setLayerSizes(layerSize);
-            tmp_MLP->setTrainMethod(ANN_MLP::BACKPROP);
-            tmp_MLP->setActivationFunction(ANN_MLP::SIGMOID_SYM,1,1);
-            
-            // Train MLP
-            tmp_MLP->train(trainingData);
-            
-            // Load final fold to test
-            vector<int> final_fold = k_idx[k];
-            Mat test_samples(number_per_fold, samples.cols, CV_32FC1);
-            Mat test_classes(number_per_fold, responses.cols, CV_32FC1);
-            // add samples to mat objects
-            for (int sample_num = 0; sample_num < (int)final_fold.size(); sample_num++)
-            {
-                samples.row(final_fold[sample_num]).copyTo(test_samples.row(sample_num));
-                test_classes.at<float>(sample_num,0) = responses.at<float>(final_fold[sample_num],0);
-                test_classes.at<float>(sample_num,1) = responses.at<float>(final_fold[sample_num],1);
-                samples_added++;
-            }
-            
-            // Test model
-            cv::Mat predictions(test_classes.rows, test_classes.cols, CV_32FC1); // new mat for results
-            tmp_MLP->predict(test_samples, predictions);
-            
-            // Determine number incorrect
-            int numIncorrect = 0;
-            for (int pnum = 0; pnum < test_classes.rows; pnum++)
-            {
-                if ((predictions.at<float>(pnum,0) > 0.8) && (predictions.at<float>(pnum,1) < -0.8))
-                {
-                    // Falsely identified as textured
-                    if (test_classes.at<float>(pnum,0) == -0.8)
-                    {
-                       numIncorrect++;
-                    }
-                }
-                else if ((predictions.at<float>(pnum,0) < -0.8) && (predictions.at<float>(pnum,1) > 0.8))
-                {
-                    // Falsely identified as not textured
-                    if (test_classes.at<float>(pnum,0) == 0.8)
-                    {
-                        numIncorrect++;
-                    }
-                }
-                else
-                {
-                    // no prediction
-                    numIncorrect++;
-                }
-            }
-            
-            // Output accuracy
-            float ccr_single = 100 - ((float)numIncorrect / test_classes.rows) * 100;
-            
-            ccr.push_back(ccr_single);
-        }
-        // determine average performance over folds
-        float total = 0;
-        for (int k = 0; k < (int)ccr.size(); k++)
-        {
-            total += ccr[k];
-        }
-        float mean_performance = total / (float)ccr.size();
-        
-        // check if this is better than other models
-        if (mean_performance > best_ccr)
-        {
-            best_ccr = mean_performance;
-            best_multiplier = hidden_layer_multiplier[i];
-        }
+        // Larger hidden layers take longer to train: start them first
+        costs.push_back(hidden_layer_multiplier[i]);
+    }
+    int best = searchParameters(modelName, candidates, costs, k_folds, [&](int point, int k)
+    {
+        return mlpFoldCCR(folds, k, foldSamples[k], foldResponses[k], hidden_layer_multiplier[point]);
+    });
+    if (best >= 0)
+    {
+        best_multiplier = hidden_layer_multiplier[best];
     }
     
     /* TRAIN BEST MODEL */
@@ -1197,6 +2062,8 @@ void TCLManager::trainAuto_mlp(Ptr<TrainData>& data, Ptr<ANN_MLP> model)
     model->setTrainMethod(ANN_MLP::BACKPROP);
     model->setActivationFunction(ANN_MLP::SIGMOID_SYM,1,1);
     
+    // (from the same random state whatever tasks ran on this thread)
+    seedSearchTask(-1);
     model->train(data);
     
 }
@@ -1212,6 +2079,57 @@ std::string TCLManager::generateFilename(int i)
     return newFilename.str();
 }
 
+// creates the filename of the projection of a size and bits
+std::string TCLManager::projectionFilename(int i)
+{
+    std::stringstream newFilename;
+    newFilename <<  "BSIF-" << bitSizes[i] << "-" << modelSizes[i] << "-projection-" << segmentationType << ".xml";
+
+    return newFilename.str();
+}
+
+
+bool TCLManager::projectsFeatures(int i)
+{
+    // Linear SVMs stream their features and never hold the training matrix a projection would be fitted on
+    return (projectionMethod != "none") && (modelTypes[i] != "lsvm") && ((1 << bitSizes[i]) > projectionDimension);
+}
+
+
+std::shared_ptr<featureProjection> TCLManager::modelProjection(int i, const cv::Mat* featuresTrain)
+{
+    std::shared_ptr<projectionEntry> entry;
+    {
+        std::lock_guard<std::mutex> guard(projectionLock);
+        std::shared_ptr<projectionEntry>& slot = projections[projectionFilename(i)];
+        if (! slot)
+        {
+            slot = std::make_shared<projectionEntry>();
+        }
+        entry = slot;
+    }
+    
+    std::lock_guard<std::mutex> guard(entry->lock);
+    if (! entry->projection)
+    {
+        std::shared_ptr<featureProjection> projection = std::make_shared<featureProjection>();
+        if (featuresTrain)
+        {
+            projection->fit(*featuresTrain, projectionMethod, projectionDimension);
+            projection->save(modelOutputDir + projectionFilename(i));
+            
+            std::lock_guard<std::mutex> outputGuard(trainingLock);
+            std::cout << "  Saved " << projectionFilename(i) << " (" << projection->inputs() << " to " << projection->outputs() << " dimensions)" << endl;
+        }
+        else if (! projection->load(modelOutputDir + projectionFilename(i)))
+        {
+            throw runtime_error("Error: Projection \"" + projectionFilename(i) + "\" not found.");
+        }
+        entry->projection = projection;
+    }
+    return entry->projection;
+}
+
 // function to create a vector from 1:n with entries equivalent to locations
 static inline void setRangeVector(std::vector<int>& vec, int n)
 {
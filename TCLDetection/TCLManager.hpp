@@ -8,14 +8,25 @@
 #define TCLManager_h
 
 #include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <sstream>
 #include "opencv2/ml.hpp"
 #include "featureExtractor.hpp"
+#include "splitList.hpp"
+#include "linearSVM.hpp"
+#include "featureProjection.hpp"
 #include "opencv2/core.hpp"
 #include "hdf5.h"
 
 #define TRAIN 0
 #define TEST 2
 
+// Copies of the training matrix a model may hold at once while training (the matrix, and its cross-validation folds laid out)
+#define TRAINING_MEMORY_COPIES 2
+
 class TCLManager
 {
 public:
@@ -34,13 +45,30 @@ private:
     bool testImages;
     bool hasBaseTruth;
     bool majorityVoting;
+    bool incrementalExtraction;
+    bool compressFeatures;
+    bool mergeShards;
+    bool featureSnapshots;
     std::string segmentationType;
+    std::string featureFormat;
+    std::string flatFeatureType;
+    std::string downsampling;
+    std::string featureMemory;
+    std::string parameterSearch;
+    std::string forestTuning;
+    std::string svmTuning;
+    std::string linearRegularizationString;
+    double linearRegularization;
+    std::string projectionMethod;
+    int compactForm;
     std::string modelString;
     std::vector<std::string> modelTypes;
     
     
     // Inputs
     std::string imageDir;
+    std::string imageArchiveFilename;
+    std::string streamSource;
     std::string splitDir;
     std::string trainingSetFilename;
     std::string testingSetFilename;
@@ -48,11 +76,27 @@ private:
     std::vector<int> modelSizes;
     std::string bitString;
     std::vector<int> bitSizes;
+    int checkpointInterval;
+    int compressionLevel;
+    int numShards;
+    int shardIndex;
+    int extractionThreads;
+    int featureCacheMB;
+    int trainingThreads;
+    int trainingMemoryMB;
+    int halvingFirstFolds;
+    int halvingRate;
+    int streamBatchRows;
+    int streamEpochs;
+    int projectionDimension;
     
     
     // Outputs
     std::string outputExtractionFilename;
     std::string outputExtractionDir;
+    std::string histogramCacheDir;
+    std::string extractionReport;
+    std::string searchLogFilename;
     std::string modelOutputDir;
     std::string classificationFilename;
     std::string classificationDirectory;
@@ -70,6 +114,37 @@ private:
     std::vector<int> trainingClass;
     std::vector<int> testingClass;
     
+    // Flat feature files stay mapped for the whole run, since loaded features wrap their memory
+    std::map<std::string, std::shared_ptr<flatFeatureFile> > flatFeatureFiles;
+    
+    // Feature matrices loaded so far, keyed by size, bits and set type, most recently used first
+    // Models sharing features (several model types per size and bits, or training then testing) reuse them instead of reloading
+    struct loadedFeatures
+    {
+        std::string key;
+        compactFeatures features;
+        cv::Mat labels;
+    };
+    std::list<loadedFeatures> featureCache;
+    std::map<std::string, std::list<loadedFeatures>::iterator> featureCacheIndex;
+    size_t featureCacheBytes;
+    
+    // Projections fitted or loaded so far, keyed by projection file: the first model of a size and bits fits it
+    // (under the lock of its entry, while models of other sizes and bits go on), the others wait for it and share it
+    struct projectionEntry
+    {
+        std::mutex lock;
+        std::shared_ptr<featureProjection> projection;
+    };
+    std::map<std::string, std::shared_ptr<projectionEntry> > projections;
+    std::mutex projectionLock;
+    
+    // Serializes feature loading and console output between the threads training models
+    std::mutex trainingLock;
+    
+    // Threads of each parameter search (k-fold x grid tasks of trainAuto_rf and trainAuto_mlp)
+    int searchThreads;
+    
     void initConfig(void);
     
     void outputStats(cv::Mat classesTest, std::vector<int>& result);
@@ -78,14 +153,59 @@ private:
     
     void loadSets(void);
     
-    void trainAuto_rf(cv::Ptr<cv::ml::TrainData>& trainData, cv::Ptr<cv::ml::RTrees> model);
+    void readSplit(const std::string& filename, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes);
+    
+    // Estimated peak memory of training model i, used to limit the models trained at once
+    size_t trainingBytes(int i);
+    
+    // Loads the features of model i, trains it and saves it
+    void trainEnsembleMember(int i);
+    
+    // Searches C and gamma of an RBF SVM in parallel, on squared distances between samples computed once for all candidates
+    void trainAuto_svm(cv::Ptr<cv::ml::TrainData>& trainData, cv::Ptr<cv::ml::SVM>& model, const std::string& modelName);
+    
+    void trainAuto_rf(cv::Ptr<cv::ml::TrainData>& trainData, cv::Ptr<cv::ml::RTrees>& model, const std::string& modelName);
+    
+    // Out-of-bag tuning: trains each random forest candidate once and replaces the model with the one of lowest out-of-bag error
+    void trainOOB_rf(cv::Ptr<cv::ml::TrainData>& trainData, cv::Ptr<cv::ml::RTrees>& model, const std::string& modelName);
+    
+    void trainAuto_mlp(cv::Ptr<cv::ml::TrainData>& data, cv::Ptr<cv::ml::ANN_MLP> model, const std::string& modelName);
+    
+    // Cross-validates the candidates of a parameter search (full grid or successive halving) and returns the best one
+    // foldCCR(candidate, k) trains a candidate on all folds but k and returns its accuracy on fold k (called from any thread)
+    int searchParameters(const std::string& modelName, const std::vector<std::string>& candidates, const std::vector<double>& costs, int k_folds, const std::function<float(int, int)>& foldCCR);
     
-    void trainAuto_mlp(cv::Ptr<cv::ml::TrainData>& data, cv::Ptr<cv::ml::ANN_MLP> model);
+    // Records a line of the parameter search log (the search log file, or the console)
+    void logSearch(const std::string& line);
     
-    void loadFeatures(cv::Mat& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType);
+    // Returns the features of a set from the feature cache, or reads them and adds them to the cache (least recently used evicted first)
+    void loadFeatures(compactFeatures& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType);
+    
+    void readFeatures(compactFeatures& outputFeatures, cv::Mat& outputLabels, int filtersize, int setType, int bitType);
+    
+    // Classes of the training or testing set, as a column of a new matrix
+    cv::Mat setLabels(int setType);
+    
+    // Opens the features of a set to be read a batch of rows at a time
+    std::unique_ptr<featureStream> openFeatureStream(int filtersize, int setType, int bitType);
+    
+    // Trains linear SVM i on batches streamed from its feature file, and saves it
+    void trainLinearSVM(int i);
+    
+    // Predicts all rows of a set, streaming its features a batch at a time
+    void streamPredictions(const cv::Ptr<cv::ml::StatModel>& model, int filtersize, int setType, int bitType, cv::Mat& results);
     
     std::string generateFilename(int i);
     
+    // File of the projection shared by the models of the size and bits of model i, next to the models
+    std::string projectionFilename(int i);
+    
+    // Whether model i is trained on projected features (a projection is set, and its histograms are larger than the dimension)
+    bool projectsFeatures(int i);
+    
+    // Returns the projection of model i: fitted on the training features (once per run, then saved) when given them, loaded otherwise
+    std::shared_ptr<featureProjection> modelProjection(int i, const cv::Mat* featuresTrain);
+    
 };
 
 static inline void setRangeVector(std::vector<int>& vec, int n);
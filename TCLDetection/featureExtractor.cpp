@@ -5,20 +5,54 @@
 
 
 #include "featureExtractor.hpp"
+#include <algorithm>
+#include <climits>
+#include <chrono>
+#include <dirent.h>
+#include <unistd.h>
 
 
 using namespace std;
 
-featureExtractor::featureExtractor(int bits, vector<string>& inFilenames, std::string& segmentationType) : bitsize(bits), segmentation(segmentationType), filenames(inFilenames) {}
+// The distinct (filter size, bit size) pairs, in the order first listed: a pair listed several times shares one feature set,
+// so its feature file is opened and extracted once
+static std::vector<std::pair<int, int> > distinctSets(const std::vector<int>& filterSizes, const std::vector<int>& bitSizes)
+{
+    std::vector<std::pair<int, int> > pairs;
+    for (int i = 0; i < (int)std::min(filterSizes.size(), bitSizes.size()); i++)
+    {
+        std::pair<int, int> pair(filterSizes[i], bitSizes[i]);
+        if (std::find(pairs.begin(), pairs.end(), pair) == pairs.end())
+        {
+            pairs.push_back(pair);
+        }
+    }
+    return pairs;
+}
+
+featureExtractor::featureExtractor(vector<string>& inFilenames, std::string& segmentationType, const extractionOptions& extractOptions) : segmentation(segmentationType), options(extractOptions), filenames(inFilenames), scheduler(extractOptions.numThreads) {}
 
-void featureExtractor::extract(std::string& outDir, std::string& outName, std::string& imageDir, int filtersize)
+void featureExtractor::extract(std::string& outDir, std::string& outName, std::string& imageDir, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes)
 {
     outputLocation = outDir + outName;
     imageLocation = imageDir;
     
     try
     {
-        filter(filtersize);
+        // Open all feature files, so each image is decoded once for all of them
+        std::vector<std::pair<int, int> > pairs = distinctSets(filterSizes, bitSizes);
+        std::vector<featureSet> sets(pairs.size());
+        for (int i = 0; i < (int)sets.size(); i++)
+        {
+            openSet(sets[i], pairs[i].first, pairs[i].second);
+        }
+        
+        filter(sets);
+        
+        for (int i = 0; i < (int)sets.size(); i++)
+        {
+            closeSet(sets[i]);
+        }
     }
     catch (runtime_error& e)
     {
@@ -31,121 +65,558 @@ void featureExtractor::extract(std::string& outDir, std::string& outName, std::s
 
 
 
-// Function produces features for filter size, bit size
-void featureExtractor::filter(int filterSize)
+void featureExtractor::openSet(featureSet& set, int filterSize, int bits)
 {
-    std::stringstream nameStream;
-    nameStream << outputLocation << "_filter_" << filterSize << "_" << filterSize << "_" << bitsize << ".hdf5";
-    string filtername = nameStream.str();
+    set.filterSize = filterSize;
+    set.bits = bits;
+    set.numExtracted = 0;
+    set.numSkipped = 0;
+    set.numCached = 0;
     
-    // Open files
-    //ofstream histOut;
-    //histOut.open(filtername, ios::out | ios::trunc);
+    // Even sizes: run the filter of half the size on the image downsampled by 50% in either direction
+    // (simulates doubling of BSIF kernel size), repeatedly: size 44 runs the 11x11 filter on the image at 1/4 resolution
+    set.octave = 0;
+    while ((filterSize > 0) && ((filterSize >> set.octave) % 2 == 0))
+    {
+        set.octave++;
+    }
+    set.filter.loadFilter(filterSize >> set.octave, bits);
+    if (! set.filter.isLoaded())
+    {
+        throw runtime_error("Error: no BSIF filter for size " + std::to_string(filterSize) + " with " + std::to_string(bits) + " bits");
+    }
+    
+    // Histogram size
+    int histsize = pow(2,bits) + 1; // add one because 0 position will not be used (need 257 slots because use positions 1-256)
+    set.histogramSize = histsize;
+    
+    // Cost model: pixels filtered (1/4 per octave) x number of filters x filter area
+    // A 17x17 12-bit set costs about 100 times a 3x3 5-bit set, so it has to start first not to be the tail of a batch
+    int base = filterSize >> set.octave;
+    set.cost = (double)bits * base * base / pow(4, set.octave);
     
-    // HDF5
-    hid_t       file_id;   /* file identifier */
-    herr_t      status;
+    // Open the feature file (reused when extracting incrementally, otherwise created from scratch)
+    // Everything written is kept if extraction stops with an error, so a rerun can resume from there
+    string filtername = featureFilename(outputLocation, filterSize, bits, options.format);
+    set.writer = openFeatureWriter(filtername, histsize - 1, options);
     
-    const char* new_filename = filtername.c_str();
-    /* Create a new file using default properties. */
-    file_id = H5Fcreate(new_filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    // Content-addressed cache shared with other feature files and splits
+    // (fast downsampling gives other histograms, so even sizes keep a cache of their own then)
+    if (! options.cacheDir.empty())
+    {
+        std::string cacheSegmentation = ((set.octave > 0) && ! options.exactDownsampling) ? (segmentation + "_fast") : segmentation;
+        set.cache.reset(new histogramCache(options.cacheDir, filterSize, bits, cacheSegmentation, histsize - 1, options));
+    }
+}
 
+
+// Function produces features for all filter sizes and bit sizes
+void featureExtractor::filter(std::vector<featureSet>& sets)
+{
+    // Image decoding and segmentation
+    imageLoader loader(imageLocation, segmentation, options.exactDownsampling, options.archiveFilename, &imageTimes);
+    int numImages = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    // Batches of a few images per thread: enough (image, set) tasks to keep every thread busy until the end of each batch
+    int batchSize = IMAGES_PER_THREAD * scheduler.threadCount();
+    cout << "  Filtering on " << scheduler.threadCount() << " threads" << endl;
     
+    // Loop through images
+    for (int first = 0; first < (int)filenames.size(); first += batchSize)
+    {
+        int last = std::min(first + batchSize, (int)filenames.size());
+        std::vector<std::string> batch(filenames.begin() + first, filenames.begin() + last);
+        int extracted = extractImages(sets, loader, batch);
+        
+        // Checkpoint: flush to disk so an interrupted run loses at most one interval of work (rounded up to a batch)
+        if ((options.checkpointInterval > 0) && (((numImages + extracted) / options.checkpointInterval) > (numImages / options.checkpointInterval)))
+        {
+            checkpoint(sets);
+            cout << "  Checkpoint: " << last << " of " << filenames.size() << " images" << endl;
+        }
+        numImages += extracted;
+    }
     
+    cout << "  Images decoded: " << loader.partialDecodes << " partially (segmentation box only), " << loader.fullDecodes << " fully" << endl;
+    writeReport(sets, loader, numImages, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+// Produces the features of a batch of images for every set that does not have them yet
+int featureExtractor::extractImages(std::vector<featureSet>& sets, imageLoader& loader, const std::vector<std::string>& batch)
+{
+    std::vector<std::unique_ptr<batchImage> > images;
+    for (int i = 0; i < (int)batch.size(); i++)
+    {
+        std::unique_ptr<batchImage> image(new batchImage);
+        image->filename = batch[i];
+        
+        // Skip images already stored by an earlier (possibly interrupted) run
+        // The finest pyramid level used (or hashed for the cache) tells whether the full resolution image has to be decoded
+        int finestOctave = INT_MAX;
+        for (int s = 0; s < (int)sets.size(); s++)
+        {
+            if (options.incremental && sets[s].writer->has(batch[i]))
+            {
+                sets[s].numSkipped++;
+                continue;
+            }
+            featureTask task;
+            task.set = &sets[s];
+            task.pixelCount = 0;
+            task.cached = false;
+            image->tasks.push_back(task);
+            
+            int levelUsed = (sets[s].cache && options.exactDownsampling) ? 0 : sets[s].octave;
+            finestOctave = std::min(finestOctave, levelUsed);
+        }
+        
+        if (image->tasks.empty())
+        {
+            continue;
+        }
+        
+        // Pyramid of the image shared by all its sets, so each image is decoded once and each level computed once
+        image->pyramid.reset(new imagePyramid(loader, batch[i], finestOctave));
+        images.push_back(std::move(image));
+    }
+    
+    // Filter in parallel: one task per image and set, the most expensive sets first
+    for (int i = 0; i < (int)images.size(); i++)
+    {
+        batchImage* image = images[i].get();
+        for (int t = 0; t < (int)image->tasks.size(); t++)
+        {
+            featureTask* task = &image->tasks[t];
+            scheduler.add(task->set->cost, [this, image, task]() { runTask(*image, *task); });
+        }
+    }
+    scheduler.run();
     
-    bool downsample = false;
-    if ((filterSize % 2) == 0)
+    // Store histograms from this thread only, in image order, so feature files do not depend on the number of threads
+    // (the 0 position is ignored: image initialized to 1s in BSIFfilter so no 0s will be present)
+    for (int i = 0; i < (int)images.size(); i++)
     {
-        downsample = true;
-        filterSize /= 2;
+        for (int t = 0; t < (int)images[i]->tasks.size(); t++)
+        {
+            featureTask& task = images[i]->tasks[t];
+            featureSet& set = *task.set;
+            stageTimer writeTimer(&set.times, STAGE_WRITE);
+            if (set.cache)
+            {
+                set.writer->writeCached(images[i]->filename, task.histogram, task.pixelCount, set.cache->filename(), task.key);
+            }
+            else
+            {
+                set.writer->write(images[i]->filename, task.histogram, task.pixelCount);
+            }
+            writeTimer.stop();
+            
+            if (task.cached)
+            {
+                set.numCached++;
+            }
+            set.numExtracted++;
+        }
     }
     
-    // Load filter
-    BSIFFilter currentFilter;
-    currentFilter.loadFilter(filterSize, bitsize);
+    return (int)images.size();
+}
+
+
+// Produces the histogram of one image for one set, on any thread of the scheduler
+void featureExtractor::runTask(batchImage& image, featureTask& task)
+{
+    featureSet& set = *task.set;
+    cv::Mat imageToFilter = image.pyramid->level(set.octave);
+    task.pixelCount = imageToFilter.cols * imageToFilter.rows;
+    task.histogram.assign(set.histogramSize, 0);
     
-    // Initialize histogram
-    int histsize = pow(2,bitsize) + 1; // add one because 0 position will not be used (need 257 slots because use positions 1-256)
-    std::vector<int> histogram(histsize, 0);
+    // Identical crops (duplicate images under other names) are filtered only once
+    // Fast downsampling may never decode the full resolution image, so its histograms are keyed by the level filtered
+    if (set.cache)
+    {
+        int keyLevel = options.exactDownsampling ? 0 : set.octave;
+        cv::Mat keyImage = image.pyramid->level(keyLevel);
+        {
+            // Hashed once per image and level, by the first task needing it
+            std::lock_guard<std::mutex> guard(image.keyLock);
+            if (keyLevel >= (int)image.keys.size())
+            {
+                image.keys.resize(keyLevel + 1);
+            }
+            if (image.keys[keyLevel].empty())
+            {
+                image.keys[keyLevel] = histogramCache::key(keyImage);
+            }
+            task.key = image.keys[keyLevel];
+        }
+        
+        std::lock_guard<std::mutex> guard(cacheLock);
+        task.cached = set.cache->lookup(task.key, task.histogram);
+    }
     
-    // create dataspace
-    hid_t       dataset_id, dataspace_id;  /* identifiers */
-    hsize_t     dims[1];
-    dims[0] = histsize - 1;
+    if (task.cached)
+    {
+        return;
+    }
+    
+    // Calculate histogram
+    set.filter.generateHistogram(imageToFilter, task.histogram, &set.times);
     
+    // Another image of the batch with the same crop may have been stored meanwhile
+    if (set.cache)
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        if (! set.cache->contains(task.key))
+        {
+            set.cache->store(task.key, task.histogram, task.pixelCount);
+        }
+    }
+}
+
+
+// A string as a JSON string literal: quotes, backslashes and control characters escaped
+static std::string jsonString(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (int i = 0; i < (int)value.size(); i++)
+    {
+        unsigned char c = value[i];
+        if ((c == '"') || (c == '\\'))
+        {
+            quoted += '\\';
+            quoted += (char)c;
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += (char)c;
+        }
+    }
+    return quoted + "\"";
+}
+
+
+// Writes the per-stage timings of the run as JSON
+void featureExtractor::writeReport(std::vector<featureSet>& sets, imageLoader& loader, int numImages, double seconds)
+{
+    if (options.reportFilename.empty())
+    {
+        return;
+    }
     
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
     
-    dataspace_id = H5Screate_simple(1, dims, NULL);
+    ofstream report(options.reportFilename);
+    if (! report.is_open())
+    {
+        throw runtime_error("Error: unable to write extraction report " + options.reportFilename);
+    }
+    report << "{" << endl;
+    report << "  \"host\": " << jsonString(host) << "," << endl;
+    report << "  \"threads\": " << scheduler.threadCount() << "," << endl;
+    report << "  \"segmentation\": " << jsonString(segmentation) << "," << endl;
+    report << "  \"images\": " << numImages << "," << endl;
+    report << "  \"seconds\": " << seconds << "," << endl;
+    report << "  \"imagesPerSecond\": " << ((seconds > 0) ? (numImages / seconds) : 0) << "," << endl;
+    report << "  \"partialDecodes\": " << loader.partialDecodes << "," << endl;
+    report << "  \"fullDecodes\": " << loader.fullDecodes << "," << endl;
+    report << "  \"imageStages\": ";
+    imageTimes.writeJSON(report, "  ");
+    report << "," << endl;
     
-    // Loop through images
-    for (int i = 0; i < (int)filenames.size(); i++)
+    // Per feature set: seconds are summed over threads, so images per second is the rate of one thread filtering only that set
+    report << "  \"featureSets\": [";
+    for (int s = 0; s < (int)sets.size(); s++)
     {
+        double setSeconds = 0;
+        for (int stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            setSeconds += sets[s].times.seconds(stage);
+        }
         
-        
-        // Load image from file
-        cv::Mat image = cv::imread((imageLocation + filenames[i]), 0);
-        
-        // create dataset
-        dataset_id = H5Dcreate2(file_id, filenames[i].c_str(), H5T_STD_I64LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-        
-        if ( image.empty() )
+        report << ((s == 0) ? "\n" : ",\n");
+        report << "    {\"size\": " << sets[s].filterSize << ", \"bits\": " << sets[s].bits << ", \"images\": " << sets[s].numExtracted << ", \"cached\": " << sets[s].numCached;
+        report << ", \"seconds\": " << setSeconds << ", \"imagesPerSecond\": " << ((setSeconds > 0) ? (sets[s].numExtracted / setSeconds) : 0) << "," << endl;
+        report << "     \"stages\": ";
+        sets[s].times.writeJSON(report, "     ");
+        report << "}";
+    }
+    report << endl << "  ]" << endl;
+    report << "}" << endl;
+    report.close();
+    
+    if (! report.good())
+    {
+        throw runtime_error("Error: unable to write extraction report " + options.reportFilename);
+    }
+    cout << "  Extraction report: " << options.reportFilename << " (" << ((seconds > 0) ? (numImages / seconds) : 0) << " images per second)" << endl;
+}
+
+
+// Flushes all feature files (and caches) to disk
+void featureExtractor::checkpoint(std::vector<featureSet>& sets)
+{
+    for (int s = 0; s < (int)sets.size(); s++)
+    {
+        if (sets[s].cache)
+        {
+            sets[s].cache->checkpoint();
+        }
+        sets[s].writer->checkpoint();
+    }
+}
+
+
+// Closes the files of a feature set and prints its summary
+void featureExtractor::closeSet(featureSet& set)
+{
+    cout << "  " << set.bits << "," << set.filterSize << ":";
+    
+    if (options.incremental)
+    {
+        cout << " " << set.numExtracted << " images extracted, " << set.numSkipped << " already present;";
+    }
+    
+    if (set.cache)
+    {
+        cout << " " << set.numCached << " histograms reused from the cache;";
+        set.cache->close();
+    }
+    
+    // Close file
+    set.writer->close();
+    
+    // Storage summary
+    if (set.writer->imageCount() > 0)
+    {
+        cout << " feature file size: " << set.writer->bytesOnDisk() << " bytes, " << (set.writer->bytesOnDisk() / set.writer->imageCount()) << " bytes per image";
+    }
+    cout << endl;
+}
+
+
+// Finds the next list of image names in a spool directory: the first by name, skipping hidden, temporary and processed files
+static bool nextSpoolFile(const std::string& directory, std::string& listName)
+{
+    DIR* dir = opendir(directory.c_str());
+    if (dir == NULL)
+    {
+        throw runtime_error("Error: spool directory " + directory + " not found");
+    }
+    
+    listName = "";
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if ((name[0] == '.') || (name.size() >= 4 && (name.compare(name.size() - 4, 4, ".tmp") == 0)) || (name.size() >= 5 && (name.compare(name.size() - 5, 5, ".done") == 0)))
         {
-            throw runtime_error("Error: unable to read image " + filenames[i] + " for feature extraction.");
+            continue;
+        }
+        if (listName.empty() || (name < listName))
+        {
+            listName = name;
+        }
+    }
+    closedir(dir);
+    
+    return ! listName.empty();
+}
+
+
+// Extracts the images named in a stream, one per line (filename or filename,class)
+void featureExtractor::streamNames(std::istream& names, std::vector<featureSet>& sets, imageLoader& loader, int& numImages)
+{
+    std::string line;
+    while (getline(names, line))
+    {
+        std::string filename = line.substr(0, line.find_first_of(",\r"));
+        if (filename.empty())
+        {
+            continue;
         }
         
-        // Segmentation
-        cv::Mat imageToUse;
-        if (segmentation == "wi")
+        // An unreadable or corrupt image is reported and skipped, the stream goes on
+        // Images are extracted as they arrive, the sets of an image in parallel
+        try
         {
-            imageToUse = image;
+            if (extractImages(sets, loader, std::vector<std::string>(1, filename)) == 0)
+            {
+                continue;
+            }
         }
-        else if (segmentation == "bg")
+        catch (runtime_error& e)
         {
-            imageToUse = image(cv::Rect(195, 125, 250, 250));
+            cout << "  " << e.what() << endl;
+            continue;
         }
-        else
+        catch (cv::Exception& e)
         {
-            throw runtime_error("Error: invalid segmentation type " + segmentation);
+            // Corrupt or unsupported images make OpenCV throw while decoding or filtering
+            cout << "  Error: unable to extract " << filename << " (" << e.what() << ")" << endl;
+            continue;
         }
         
-        // Save image information
-        //histOut << filenames[i] << ",";
-        //downHistOut << filenames[i] << ",";
+        // Checkpoint: flush to disk so an interrupted run loses at most one interval of work
+        numImages++;
+        if ((options.checkpointInterval > 0) && ((numImages % options.checkpointInterval) == 0))
+        {
+            checkpoint(sets);
+            cout << "  Checkpoint: " << numImages << " images extracted" << endl;
+        }
+    }
+}
+
+
+void featureExtractor::stream(std::string& outDir, std::string& outName, std::string& imageDir, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes, const std::string& source)
+{
+    outputLocation = outDir + outName;
+    imageLocation = imageDir;
+    
+    // New images are appended to the feature files, images already in them are skipped
+    options.incremental = true;
+    
+    try
+    {
+        std::vector<std::pair<int, int> > pairs = distinctSets(filterSizes, bitSizes);
+        std::vector<featureSet> sets(pairs.size());
+        for (int i = 0; i < (int)sets.size(); i++)
+        {
+            openSet(sets[i], pairs[i].first, pairs[i].second);
+        }
+        
+        imageLoader loader(imageLocation, segmentation, options.exactDownsampling, options.archiveFilename, &imageTimes);
+        int numImages = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
         
-        if (downsample)
+        if (source == STREAM_STDIN)
         {
-            // Downsample image by 50% in either direction
-            cv::Mat downImage;
-            cv::pyrDown(imageToUse, downImage, cv::Size(imageToUse.cols / 2, imageToUse.rows / 2));
-            
-            // Run filter on downsampled image (simulates doubling of BSIF kernel size)
-            currentFilter.generateHistogram(downImage, histogram);
-            
+            cout << "  Reading image names from standard input until end of file" << endl;
+            streamNames(std::cin, sets, loader, numImages);
         }
         else
         {
-            // Calculate histograms for full sized image
-            currentFilter.generateHistogram(imageToUse, histogram);
-            
+            // Spool directory: lists are processed in name order and renamed to .done once their features are on disk
+            // Writers should create lists under a temporary (.tmp) or hidden name and rename them when complete
+            cout << "  Watching " << source << " for lists of image names until a .stop file appears" << endl;
+            std::string listName;
+            while (true)
+            {
+                if (nextSpoolFile(source, listName))
+                {
+                    std::string listPath = source + "/" + listName;
+                    ifstream list(listPath);
+                    streamNames(list, sets, loader, numImages);
+                    list.close();
+                    
+                    checkpoint(sets);
+                    if (rename(listPath.c_str(), (listPath + ".done").c_str()) != 0)
+                    {
+                        throw runtime_error("Error: unable to mark " + listPath + " as done");
+                    }
+                    cout << "  " << listName << " done (" << numImages << " images extracted)" << endl;
+                }
+                else if (access((source + "/.stop").c_str(), F_OK) == 0)
+                {
+                    break;
+                }
+                else
+                {
+                    sleep(SPOOL_POLL_SECONDS);
+                }
+            }
         }
-        // Ignore 0 position in histogram (image initialized to 1s in BSIFfilter so no 0s will be present)
-        // Only go to (histsize - 1) to output endl after last
-        //for (int i = 1; i < (histsize - 1); i++) histOut << histogram[i] << ", ";
-        // Need to output endl after last column instead of ","
-        //histOut << histogram[histsize - 1] << std::endl;
-        
-        int *array_from_vector = &histogram[1]; // skip zero slot
-        status = H5Dwrite(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, array_from_vector);
         
-        std::fill(histogram.begin(), histogram.end(), 0);
+        cout << "  Images decoded: " << loader.partialDecodes << " partially (segmentation box only), " << loader.fullDecodes << " fully" << endl;
+        writeReport(sets, loader, numImages, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
         
-        status = H5Dclose(dataset_id);
+        for (int i = 0; i < (int)sets.size(); i++)
+        {
+            closeSet(sets[i]);
+        }
+    }
+    catch (runtime_error& e)
+    {
+        throw e;
     }
+}
+
 
-    // Close files
-    //histOut.close();
-    /* Terminate access to the data space. */
-    status = H5Sclose(dataspace_id);
-    /* Terminate access to the file. */
-    status = H5Fclose(file_id);
+void featureExtractor::merge(std::string& outDir, std::string& outName, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes, int numShards)
+{
+    outputLocation = outDir + outName;
+    
+    // Manifests of all shards, which only exist once a shard has completed
+    std::vector<std::vector<std::string> > shardNames(numShards);
+    for (int k = 0; k < numShards; k++)
+    {
+        if (! readShardManifest(outputLocation, k, numShards, shardNames[k]))
+        {
+            throw runtime_error("Error: shard " + std::to_string(k) + " of " + std::to_string(numShards) + " has not completed (no manifest found)");
+        }
+    }
+    
+    // Every image of the training and testing sets must be in exactly one shard
+    std::unordered_map<std::string, int> shardOf;
+    for (int i = 0; i < (int)filenames.size(); i++)
+    {
+        shardOf[filenames[i]] = -1;
+    }
+    for (int k = 0; k < numShards; k++)
+    {
+        for (int i = 0; i < (int)shardNames[k].size(); i++)
+        {
+            std::unordered_map<std::string, int>::iterator it = shardOf.find(shardNames[k][i]);
+            if (it == shardOf.end())
+            {
+                throw runtime_error("Error: shard " + std::to_string(k) + " holds " + shardNames[k][i] + ", which is not in the training or testing set");
+            }
+            if (it->second >= 0)
+            {
+                throw runtime_error("Error: " + shardNames[k][i] + " was extracted by shards " + std::to_string(it->second) + " and " + std::to_string(k));
+            }
+            it->second = k;
+        }
+    }
+    for (std::unordered_map<std::string, int>::iterator it = shardOf.begin(); it != shardOf.end(); ++it)
+    {
+        if (it->second < 0)
+        {
+            throw runtime_error("Error: " + it->first + " was not extracted by any shard");
+        }
+    }
+    
+    // Merge the shard files of each feature set into a new feature file
+    extractionOptions mergeOptions = options;
+    mergeOptions.incremental = false;
+    std::vector<std::pair<int, int> > pairs = distinctSets(filterSizes, bitSizes);
+    for (int i = 0; i < (int)pairs.size(); i++)
+    {
+        int filterSize = pairs[i].first;
+        int bits = pairs[i].second;
+        int histLength = pow(2, bits);
+        std::string filtername = featureFilename(outputLocation, filterSize, bits, options.format);
+        std::unique_ptr<featureWriter> writer = openFeatureWriter(filtername, histLength, mergeOptions);
+        
+        for (int k = 0; k < numShards; k++)
+        {
+            writer->merge(featureFilename(shardPrefix(outputLocation, k, numShards), filterSize, bits, options.format), shardNames[k]);
+        }
+        writer->close();
+        
+        if (writer->imageCount() != (int)shardOf.size())
+        {
+            throw runtime_error("Error: merged feature file " + filtername + " holds " + std::to_string(writer->imageCount()) + " images instead of " + std::to_string(shardOf.size()));
+        }
+        cout << "  " << bits << "," << filterSize << ": " << writer->imageCount() << " images merged into " << filtername << endl;
+    }
 }
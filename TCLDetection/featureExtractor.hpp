@@ -10,25 +10,85 @@
 #include <stdio.h>
 #include <iostream>
 #include <fstream>
-#include "hdf5.h"
 #include "BSIFFilter.hpp"
+#include "featureStore.hpp"
+#include "imageLoader.hpp"
+#include "taskScheduler.hpp"
+
+
+// Streaming extraction: image names read from standard input, or from lists dropped in a spool directory
+#define STREAM_STDIN "stdin"
+#define SPOOL_POLL_SECONDS 1
+
+// Images whose (image, feature set) tasks are scheduled together, per thread
+#define IMAGES_PER_THREAD 4
 
 
 class featureExtractor
 {
 public:
-    featureExtractor(int bits, std::vector<std::string>& inFilenames, std::string& segmentationType);
+    featureExtractor(std::vector<std::string>& inFilenames, std::string& segmentationType, const extractionOptions& extractOptions = extractionOptions());
+    
+    
+    // Extracts the features of all images for each pair of filter size and bit size (one feature file per pair)
+    void extract(std::string& outDir, std::string& outName, std::string& imageDir, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes);
     
+    // Extracts images as their names arrive (from STREAM_STDIN or a spool directory), appending to the feature files
+    void stream(std::string& outDir, std::string& outName, std::string& imageDir, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes, const std::string& source);
     
-    void extract(std::string& outDir, std::string& outName, std::string& imageDir, int filtersize);
+    // Combines the feature files of all shards into the final feature files, checking each image was extracted by exactly one shard
+    void merge(std::string& outDir, std::string& outName, const std::vector<int>& filterSizes, const std::vector<int>& bitSizes, int numShards);
     
 private:
-    // Filter information
-    int bitsize;
+    // One feature file being produced: a filter size and bit size
+    struct featureSet
+    {
+        int filterSize;
+        int bits;
+        int octave;
+        BSIFFilter filter;
+        int histogramSize;
+        std::unique_ptr<featureWriter> writer;
+        std::unique_ptr<histogramCache> cache;
+        
+        // Estimated cost of filtering one image, used to start the expensive tasks first
+        double cost;
+        
+        // Time spent filtering and writing, per stage
+        stageProfile times;
+        
+        // Progress counters
+        int numExtracted;
+        int numSkipped;
+        int numCached;
+    };
+    
+    // The histogram of one image for one feature set: the unit of work of the scheduler
+    struct featureTask
+    {
+        featureSet* set;
+        std::vector<int> histogram;
+        std::string key;
+        int pixelCount;
+        bool cached;
+    };
+    
+    // An image of a batch: its pyramid and cache keys, shared by the tasks of its feature sets
+    struct batchImage
+    {
+        std::string filename;
+        std::unique_ptr<imagePyramid> pyramid;
+        std::vector<std::string> keys;
+        std::mutex keyLock;
+        std::vector<featureTask> tasks;
+    };
     
     // Segmentation information
     std::string segmentation;
     
+    // Output format, incremental extraction and checkpointing
+    extractionOptions options;
+    
     // Output information
     std::string outputLocation;
     
@@ -38,8 +98,39 @@ private:
     // List of filenames
     std::vector<std::string>& filenames;
     
-    // Function produces features for filter size and its double (through downsampling)
-    void filter(int filterSize);
+    // Threads running the (image, feature set) tasks
+    taskScheduler scheduler;
+    
+    // Serializes the histogram cache (the HDF5 library is not thread-safe)
+    std::mutex cacheLock;
+    
+    // Time spent reading, decoding, cropping and downsampling images, per stage
+    stageProfile imageTimes;
+    
+    // Loads filters and opens the feature file of a set (and its histogram cache)
+    void openSet(featureSet& set, int filterSize, int bits);
+    
+    // Loops through the images in batches, decoding each once for all feature sets
+    void filter(std::vector<featureSet>& sets);
+    
+    // Extracts a batch of images for the sets missing them, in parallel, and writes them in order
+    // Returns the number of images with new features (images all sets already have are skipped)
+    int extractImages(std::vector<featureSet>& sets, imageLoader& loader, const std::vector<std::string>& batch);
+    
+    // Produces the histogram of one task (runs on any thread)
+    void runTask(batchImage& image, featureTask& task);
+    
+    // Extracts the images named in a stream, one per line
+    void streamNames(std::istream& names, std::vector<featureSet>& sets, imageLoader& loader, int& numImages);
+    
+    // Writes the JSON report of a run: images per second overall, time per stage for the images and for each feature set
+    void writeReport(std::vector<featureSet>& sets, imageLoader& loader, int numImages, double seconds);
+    
+    // Flushes all feature files to disk
+    void checkpoint(std::vector<featureSet>& sets);
+    
+    // Closes the files of a set and reports on it
+    void closeSet(featureSet& set);
 };
 
 
@@ -0,0 +1,104 @@
+//
+//  featureProjection.cpp
+//  TCLDetection
+
+
+
+#include "featureProjection.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+
+using namespace std;
+
+
+featureProjection::featureProjection()
+{
+}
+
+
+void featureProjection::fit(const cv::Mat& features, const std::string& method, int dimension)
+{
+    if ((dimension < 1) || (dimension > features.cols) || (features.type() != CV_32FC1))
+    {
+        throw runtime_error("Error: cannot project features of " + to_string(features.cols) + " dimensions to " + to_string(dimension));
+    }
+
+    this->method = method;
+    if (method == "pca")
+    {
+        // Leading eigenvectors of the covariance of the training rows
+        cv::PCA pca(features, cv::noArray(), cv::PCA::DATA_AS_ROW, dimension);
+        pca.mean.convertTo(mean, CV_32F);
+        pca.eigenvectors.convertTo(basis, CV_32F);
+    }
+    else if (method == "random")
+    {
+        // Gaussian entries of variance 1 / dimension preserve distances between rows on average
+        mean.release();
+        basis.create(dimension, features.cols, CV_32FC1);
+        cv::RNG rng(0xffffffff);
+        rng.fill(basis, cv::RNG::NORMAL, 0.0, 1.0 / std::sqrt((double)dimension));
+    }
+    else
+    {
+        throw runtime_error("Error: invalid projection " + method);
+    }
+}
+
+
+cv::Mat featureProjection::apply(const cv::Mat& rows) const
+{
+    if ((rows.cols != basis.cols) || (rows.type() != CV_32FC1))
+    {
+        throw runtime_error("Error: features do not match the projection");
+    }
+
+    cv::Mat projected;
+    cv::gemm(rows, basis, 1, cv::noArray(), 0, projected, cv::GEMM_2_T);
+
+    // (x - mean) basis^T: the projected mean is subtracted from every row
+    if (! mean.empty())
+    {
+        cv::Mat offset;
+        cv::gemm(mean, basis, 1, cv::noArray(), 0, offset, cv::GEMM_2_T);
+        for (int r = 0; r < projected.rows; r++)
+        {
+            cv::Mat row = projected.row(r);
+            cv::subtract(row, offset, row);
+        }
+    }
+    return projected;
+}
+
+
+void featureProjection::save(const std::string& filename) const
+{
+    cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+    if (! fs.isOpened())
+    {
+        throw runtime_error("Error: cannot write projection " + filename);
+    }
+    fs << "method" << method;
+    fs << "mean" << mean;
+    fs << "basis" << basis;
+}
+
+
+bool featureProjection::load(const std::string& filename)
+{
+    cv::FileStorage fs(filename, cv::FileStorage::READ);
+    if (! fs.isOpened())
+    {
+        return false;
+    }
+    fs["method"] >> method;
+    fs["mean"] >> mean;
+    fs["basis"] >> basis;
+    if (basis.empty() || (! mean.empty() && (mean.cols != basis.cols)))
+    {
+        throw runtime_error("Error: invalid projection " + filename);
+    }
+    return true;
+}
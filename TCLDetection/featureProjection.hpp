@@ -0,0 +1,44 @@
+//
+//  featureProjection.hpp
+//  TCLDetection
+
+
+
+#ifndef featureProjection_hpp
+#define featureProjection_hpp
+
+#include <string>
+#include "opencv2/core.hpp"
+
+
+// Linear projection of histograms to fewer dimensions, y = (x - mean) basis^T: the leading principal components
+// of the training features ("pca"), or a Gaussian random matrix ("random", mean zero). Fitted once per filter size
+// and bit size, and saved next to the models so testing projects features the same way.
+class featureProjection
+{
+public:
+    featureProjection();
+
+    // Fits a projection of the rows of features (float32) to the given number of dimensions
+    // Random projections only use the number of columns, and are the same on every run
+    void fit(const cv::Mat& features, const std::string& method, int dimension);
+
+    // Projects float32 rows, returning a new matrix of outputs() columns
+    cv::Mat apply(const cv::Mat& rows) const;
+
+    int inputs() const { return basis.cols; }
+    int outputs() const { return basis.rows; }
+    bool empty() const { return basis.empty(); }
+
+    void save(const std::string& filename) const;
+
+    // Returns false if there is no projection file
+    bool load(const std::string& filename);
+
+private:
+    std::string method;
+    cv::Mat mean;
+    cv::Mat basis;
+};
+
+#endif /* featureProjection_hpp */
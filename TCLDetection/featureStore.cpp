@@ -0,0 +1,1171 @@
+//
+//  featureStore.cpp
+//  TCLDetection
+
+
+
+#include "featureStore.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+static const char flatMagic[8] = {'T', 'C', 'L', 'F', 'E', 'A', 'T', '\0'};
+static const uint32_t flatVersion = 1;
+static const uint64_t flatDataOffset = 4096; // page aligned, so the mapped matrix is aligned too
+static const char snapshotMagic[8] = {'T', 'C', 'L', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t snapshotVersion = 1;
+
+
+// Builds the name of the feature file for a BSIF size and bit size
+std::string featureFilename(const std::string& prefix, int filterSize, int bits, const std::string& format)
+{
+    std::stringstream nameStream;
+    nameStream << prefix << "_filter_" << filterSize << "_" << filterSize << "_" << bits << "." << format;
+    return nameStream.str();
+}
+
+
+// Z-score normalizes a row of features in place
+void normalizeFeatures(cv::Mat row)
+{
+    cv::Scalar mean;
+    cv::Scalar stddev;
+
+    meanStdDev(row, mean, stddev);
+
+    // (value - mean) / stddev as one vectorized scale and shift
+    row.convertTo(row, CV_32FC1, 1.0 / stddev[0], -mean[0] / stddev[0]);
+}
+
+
+void normalizeFeatureRows(cv::Mat features)
+{
+    cv::parallel_for_(cv::Range(0, features.rows), [&](const cv::Range& range)
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            normalizeFeatures(features.row(i));
+        }
+    });
+}
+
+
+// Reads the histograms of a list of images into the rows of a matrix (CV_32FC1 or CV_16UC1), in list order
+// Returns false if a histogram has counts that do not fit in uint16 rows
+static bool readHDF5Rows(const std::string& filename, const std::vector<std::string>& imageNames, cv::Mat& rows)
+{
+    // Keep the files external links point to (histogram caches) open, instead of reopening one per image
+    hid_t fapl_id = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_elink_file_cache_size(fapl_id, 16);
+    hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, fapl_id);
+    H5Pclose(fapl_id);
+    if (file_id < 0)
+    {
+        throw runtime_error("Error: no features found in " + filename);
+    }
+
+    bool counts = (rows.type() == CV_16UC1);
+    std::vector<unsigned int> wideCounts(rows.cols);
+    bool fits = true;
+    for (int i = 0; fits && (i < (int)imageNames.size()); i++)
+    {
+        hid_t dataset_id = H5Dopen2(file_id, imageNames[i].c_str(), H5P_DEFAULT);
+        if (dataset_id < 0)
+        {
+            H5Fclose(file_id);
+            throw runtime_error("Error: features for " + imageNames[i] + " not found in " + filename);
+        }
+
+        // The row is the read buffer, so the histogram must have exactly one value per column
+        hid_t space_id = H5Dget_space(dataset_id);
+        hssize_t length = H5Sget_simple_extent_npoints(space_id);
+        H5Sclose(space_id);
+        hid_t type_id = H5Dget_type(dataset_id);
+        size_t storedSize = H5Tget_size(type_id);
+        H5Tclose(type_id);
+
+        herr_t status = -1;
+        if ((length == rows.cols) && ! counts)
+        {
+            // HDF5 converts the stored counts to float
+            status = H5Dread(dataset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, rows.ptr<float>(i));
+        }
+        else if ((length == rows.cols) && (storedSize <= sizeof(unsigned short)))
+        {
+            status = H5Dread(dataset_id, H5T_NATIVE_USHORT, H5S_ALL, H5S_ALL, H5P_DEFAULT, rows.ptr<unsigned short>(i));
+        }
+        else if (length == rows.cols)
+        {
+            // Stored as 32-bit counts (more than 65535 pixels filtered): only usable if every count fits
+            status = H5Dread(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &wideCounts[0]);
+            for (int j = 0; j < rows.cols; j++)
+            {
+                fits = fits && (wideCounts[j] <= USHRT_MAX);
+                rows.ptr<unsigned short>(i)[j] = (unsigned short)wideCounts[j];
+            }
+        }
+        H5Dclose(dataset_id);
+
+        if (status < 0)
+        {
+            H5Fclose(file_id);
+            throw runtime_error("Error: unable to read the features of " + imageNames[i] + " from " + filename);
+        }
+    }
+    H5Fclose(file_id);
+
+    return fits;
+}
+
+
+cv::Mat loadHDF5Features(const std::string& filename, const std::vector<std::string>& imageNames, int histLength)
+{
+    cv::Mat features((int)imageNames.size(), histLength, CV_32FC1);
+    readHDF5Rows(filename, imageNames, features);
+    normalizeFeatureRows(features);
+    return features;
+}
+
+
+cv::Mat loadHDF5Counts(const std::string& filename, const std::vector<std::string>& imageNames, int histLength)
+{
+    cv::Mat counts((int)imageNames.size(), histLength, CV_16UC1);
+    if (! readHDF5Rows(filename, imageNames, counts))
+    {
+        return cv::Mat();
+    }
+    return counts;
+}
+
+
+// Compact feature matrices
+compactFeatures::compactFeatures(const cv::Mat& normalized, int compactForm) : storedForm(compactForm)
+{
+    if (storedForm == COMPACT_FLOAT16)
+    {
+        cv::convertFp16(normalized, data);
+    }
+    else if (storedForm == COMPACT_FLOAT)
+    {
+        data = normalized;
+    }
+    else
+    {
+        throw runtime_error("Error: compact uint16 features need raw counts");
+    }
+}
+
+compactFeatures compactFeatures::fromCounts(const cv::Mat& counts)
+{
+    compactFeatures features;
+    features.data = counts;
+    features.storedForm = COMPACT_UINT16;
+    return features;
+}
+
+// Expands stored rows into normalized float32 rows of the same size
+static void expandRows(const cv::Mat& stored, int form, cv::Mat dst)
+{
+    if (form == COMPACT_FLOAT16)
+    {
+        cv::convertFp16(stored, dst);
+    }
+    else
+    {
+        stored.convertTo(dst, CV_32FC1);
+        for (int i = 0; i < dst.rows; i++)
+        {
+            normalizeFeatures(dst.row(i));
+        }
+    }
+}
+
+cv::Mat compactFeatures::block(int first, int last) const
+{
+    if (storedForm == COMPACT_FLOAT)
+    {
+        return data.rowRange(first, last);
+    }
+    cv::Mat expanded(last - first, data.cols, CV_32FC1);
+    expandRows(data.rowRange(first, last), storedForm, expanded);
+    return expanded;
+}
+
+cv::Mat compactFeatures::toFloat(void) const
+{
+    if (storedForm == COMPACT_FLOAT)
+    {
+        return data;
+    }
+
+    // Blocks of rows expanded in parallel, each straight into its part of the result
+    cv::Mat expanded(data.rows, data.cols, CV_32FC1);
+    cv::parallel_for_(cv::Range(0, (data.rows + COMPACT_BLOCK_ROWS - 1) / COMPACT_BLOCK_ROWS), [&](const cv::Range& range)
+    {
+        for (int b = range.start; b < range.end; b++)
+        {
+            int first = b * COMPACT_BLOCK_ROWS;
+            int last = std::min(first + COMPACT_BLOCK_ROWS, data.rows);
+            expandRows(data.rowRange(first, last), storedForm, expanded.rowRange(first, last));
+        }
+    });
+    return expanded;
+}
+
+
+
+
+
+// Sharded extraction
+std::string shardPrefix(const std::string& prefix, int shard, int numShards)
+{
+    std::stringstream nameStream;
+    nameStream << prefix << "_shard_" << shard << "_of_" << numShards;
+    return nameStream.str();
+}
+
+void writeShardManifest(const std::string& prefix, int shard, int numShards, const std::vector<std::string>& names)
+{
+    // Written under a temporary name and renamed, so a manifest only exists for a complete shard
+    std::string manifestName = shardPrefix(prefix, shard, numShards) + ".manifest";
+    ofstream manifest(manifestName + ".tmp");
+    manifest << "shard " << shard << " of " << numShards << endl;
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        manifest << names[i] << endl;
+    }
+    manifest.close();
+
+    if (manifest.fail() || (rename((manifestName + ".tmp").c_str(), manifestName.c_str()) != 0))
+    {
+        throw runtime_error("Error: unable to write shard manifest " + manifestName);
+    }
+}
+
+bool readShardManifest(const std::string& prefix, int shard, int numShards, std::vector<std::string>& names)
+{
+    std::string manifestName = shardPrefix(prefix, shard, numShards) + ".manifest";
+    ifstream manifest(manifestName);
+    if (! manifest.good())
+    {
+        return false;
+    }
+
+    std::string currentName;
+    std::stringstream expected;
+    expected << "shard " << shard << " of " << numShards;
+    if (! getline(manifest, currentName) || (currentName != expected.str()))
+    {
+        throw runtime_error("Error: invalid shard manifest " + manifestName);
+    }
+
+    names.clear();
+    while (getline(manifest, currentName))
+    {
+        names.push_back(currentName);
+    }
+    return true;
+}
+
+
+
+
+
+featureWriter::featureWriter(const std::string& filename) : path(filename), numImages(0) {}
+
+void featureWriter::writeCached(const std::string& name, const std::vector<int>& histogram, int pixelCount, const std::string& /*cacheFile*/, const std::string& /*key*/)
+{
+    write(name, histogram, pixelCount);
+}
+
+unsigned long long featureWriter::bytesOnDisk(void)
+{
+    struct stat fileInfo;
+    if (stat(path.c_str(), &fileInfo) != 0)
+    {
+        return 0;
+    }
+    return (unsigned long long)fileInfo.st_size;
+}
+
+
+// Opens a writer for the format in the options
+std::unique_ptr<featureWriter> openFeatureWriter(const std::string& filename, int histLength, const extractionOptions& options)
+{
+    if (options.format == FORMAT_HDF5)
+    {
+        return std::unique_ptr<featureWriter>(new hdf5FeatureWriter(filename, histLength, options));
+    }
+    else if (options.format == FORMAT_FLAT)
+    {
+        return std::unique_ptr<featureWriter>(new flatFeatureWriter(filename, histLength, options));
+    }
+    throw runtime_error("Error: invalid feature file format " + options.format);
+}
+
+
+
+
+
+// HDF5 feature file
+hdf5FeatureWriter::hdf5FeatureWriter(const std::string& filename, int histLength, const extractionOptions& options) : featureWriter(filename), file_id(-1), dataspace_id(-1), dcpl_id(H5P_DEFAULT)
+{
+    const char* new_filename = filename.c_str();
+
+    // Reuse the existing file when extracting incrementally, otherwise start from scratch
+    ifstream existingFile(filename);
+    if (options.incremental && existingFile.good())
+    {
+        existingFile.close();
+        file_id = H5Fopen(new_filename, H5F_ACC_RDWR, H5P_DEFAULT);
+
+        if (file_id < 0)
+        {
+            throw runtime_error("Error: unable to reopen feature file " + filename + " for incremental extraction.");
+        }
+
+        // Count the images already in the file
+        H5G_info_t groupInfo;
+        if (H5Gget_info(file_id, &groupInfo) >= 0)
+        {
+            numImages = (int)groupInfo.nlinks;
+        }
+    }
+    else
+    {
+        /* Create a new file using default properties. */
+        file_id = H5Fcreate(new_filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+
+        if (file_id < 0)
+        {
+            throw runtime_error("Error: unable to create feature file " + filename);
+        }
+    }
+
+    // create dataspace
+    dims[0] = histLength;
+    dataspace_id = H5Screate_simple(1, dims, NULL);
+
+    // Dataset creation properties: chunked with shuffle + deflate when compressing
+    if (options.compress)
+    {
+        if (H5Zfilter_avail(H5Z_FILTER_DEFLATE) > 0)
+        {
+            dcpl_id = H5Pcreate(H5P_DATASET_CREATE);
+            H5Pset_chunk(dcpl_id, 1, dims);
+            H5Pset_shuffle(dcpl_id);
+            H5Pset_deflate(dcpl_id, options.compressionLevel);
+        }
+        else
+        {
+            cout << "  Deflate filter not available in this HDF5 build, features will not be compressed" << endl;
+        }
+    }
+
+    counts16.resize(histLength, 0);
+    counts32.resize(histLength, 0);
+}
+
+hdf5FeatureWriter::~hdf5FeatureWriter()
+{
+    close();
+}
+
+// Checks for a complete histogram of an image
+bool hdf5FeatureWriter::has(const std::string& name)
+{
+    if (H5Lexists(file_id, name.c_str(), H5P_DEFAULT) <= 0)
+    {
+        return false;
+    }
+
+    // An external link whose cache file was deleted or moved cannot be opened: remove it, so the image is extracted again
+    hid_t dataset_id = H5Dopen2(file_id, name.c_str(), H5P_DEFAULT);
+    if (dataset_id < 0)
+    {
+        H5Ldelete(file_id, name.c_str(), H5P_DEFAULT);
+        numImages--;
+        return false;
+    }
+
+    // Storage is only allocated on the first write (late for contiguous datasets, incremental for chunked ones),
+    // so a dataset left behind by a crash between create and write has none; a wrong length means a different bit size
+    hid_t space_id = H5Dget_space(dataset_id);
+    hsize_t storedDims[1] = {0};
+    int rank = H5Sget_simple_extent_ndims(space_id);
+    if (rank == 1)
+    {
+        H5Sget_simple_extent_dims(space_id, storedDims, NULL);
+    }
+    bool complete = (rank == 1) && (storedDims[0] == dims[0]) && (H5Dget_storage_size(dataset_id) > 0);
+    H5Sclose(space_id);
+    H5Dclose(dataset_id);
+
+    // Remove incomplete entries so they are extracted again
+    if (! complete)
+    {
+        H5Ldelete(file_id, name.c_str(), H5P_DEFAULT);
+        numImages--;
+    }
+
+    return complete;
+}
+
+void hdf5FeatureWriter::write(const std::string& name, const std::vector<int>& histogram, int pixelCount)
+{
+    // No bin can hold more than the number of pixels filtered, so store the narrowest unsigned type that fits.
+    // The buffer written matches the file type, so HDF5 does not convert on write.
+    // The dataset is only created once the histogram exists, so a crash never leaves an empty dataset behind.
+    bool narrow = (pixelCount <= USHRT_MAX);
+    if (narrow)
+    {
+        std::copy(histogram.begin() + 1, histogram.end(), counts16.begin()); // skip zero slot
+    }
+    else
+    {
+        std::copy(histogram.begin() + 1, histogram.end(), counts32.begin()); // skip zero slot
+    }
+
+    hid_t dataset_id = H5Dcreate2(file_id, name.c_str(), narrow ? H5T_STD_U16LE : H5T_STD_U32LE, dataspace_id, H5P_DEFAULT, dcpl_id, H5P_DEFAULT);
+    if (dataset_id < 0)
+    {
+        throw runtime_error("Error: unable to store features of " + name + " in " + path);
+    }
+
+    herr_t status = narrow ? H5Dwrite(dataset_id, H5T_NATIVE_USHORT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &counts16[0])
+                           : H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &counts32[0]);
+    H5Dclose(dataset_id);
+
+    // A failed write must not leave a dataset behind that would be counted, or read, as features
+    if (status < 0)
+    {
+        H5Ldelete(file_id, name.c_str(), H5P_DEFAULT);
+        throw runtime_error("Error: unable to store features of " + name + " in " + path);
+    }
+
+    numImages++;
+}
+
+// Links the image to the cached histogram instead of storing another copy
+void hdf5FeatureWriter::writeCached(const std::string& name, const std::vector<int>& /*histogram*/, int /*pixelCount*/, const std::string& cacheFile, const std::string& key)
+{
+    if (H5Lcreate_external(cacheFile.c_str(), key.c_str(), file_id, name.c_str(), H5P_DEFAULT, H5P_DEFAULT) < 0)
+    {
+        throw runtime_error("Error: unable to store features of " + name + " in " + path);
+    }
+    numImages++;
+}
+
+bool hdf5FeatureWriter::read(const std::string& name, std::vector<int>& histogram)
+{
+    if (H5Lexists(file_id, name.c_str(), H5P_DEFAULT) <= 0)
+    {
+        return false;
+    }
+
+    hid_t dataset_id = H5Dopen2(file_id, name.c_str(), H5P_DEFAULT);
+    if (dataset_id < 0)
+    {
+        return false;
+    }
+    herr_t status = H5Dread(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &histogram[1]); // skip zero slot
+    H5Dclose(dataset_id);
+
+    return status >= 0;
+}
+
+void hdf5FeatureWriter::merge(const std::string& shardFile, const std::vector<std::string>& names)
+{
+    hid_t shard_id = H5Fopen(shardFile.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (shard_id < 0)
+    {
+        throw runtime_error("Error: unable to open shard feature file " + shardFile);
+    }
+
+    std::vector<char> linkValue;
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        const char* name = names[i].c_str();
+        H5L_info_t linkInfo;
+        if ((H5Lexists(shard_id, name, H5P_DEFAULT) <= 0) || (H5Lget_info(shard_id, name, &linkInfo, H5P_DEFAULT) < 0))
+        {
+            H5Fclose(shard_id);
+            throw runtime_error("Error: features of " + names[i] + " missing from shard feature file " + shardFile);
+        }
+        if (H5Lexists(file_id, name, H5P_DEFAULT) > 0)
+        {
+            H5Fclose(shard_id);
+            throw runtime_error("Error: features of " + names[i] + " found in more than one shard");
+        }
+
+        herr_t status;
+        if (linkInfo.type == H5L_TYPE_EXTERNAL)
+        {
+            // Histograms in the cache stay there: link to them again
+            linkValue.resize(linkInfo.u.val_size);
+            const char* cacheFile = NULL;
+            const char* key = NULL;
+            status = H5Lget_val(shard_id, name, &linkValue[0], linkValue.size(), H5P_DEFAULT);
+            if (status >= 0)
+            {
+                status = H5Lunpack_elink_val(&linkValue[0], linkValue.size(), NULL, &cacheFile, &key);
+            }
+            if (status >= 0)
+            {
+                status = H5Lcreate_external(cacheFile, key, file_id, name, H5P_DEFAULT, H5P_DEFAULT);
+            }
+        }
+        else
+        {
+            // Copied as stored (type and filters included)
+            status = H5Ocopy(shard_id, name, file_id, name, H5P_DEFAULT, H5P_DEFAULT);
+        }
+
+        if (status < 0)
+        {
+            H5Fclose(shard_id);
+            throw runtime_error("Error: unable to merge features of " + names[i] + " into " + path);
+        }
+        numImages++;
+    }
+
+    H5Fclose(shard_id);
+}
+
+void hdf5FeatureWriter::checkpoint()
+{
+    H5Fflush(file_id, H5F_SCOPE_GLOBAL);
+}
+
+void hdf5FeatureWriter::close()
+{
+    if (dcpl_id != H5P_DEFAULT)
+    {
+        H5Pclose(dcpl_id);
+        dcpl_id = H5P_DEFAULT;
+    }
+    if (dataspace_id >= 0)
+    {
+        /* Terminate access to the data space. */
+        H5Sclose(dataspace_id);
+        dataspace_id = -1;
+    }
+    if (file_id >= 0)
+    {
+        /* Terminate access to the file. */
+        H5Fclose(file_id);
+        file_id = -1;
+    }
+}
+
+
+
+
+
+// Histogram cache
+// The cache file is always reopened, whatever the feature files do
+static extractionOptions cacheOptions(const extractionOptions& options)
+{
+    extractionOptions reopen = options;
+    reopen.incremental = true;
+    return reopen;
+}
+
+histogramCache::histogramCache(const std::string& directory, int filterSize, int bits, const std::string& segmentation, int histLength, const extractionOptions& options) : cachePath(cacheFilename(directory, filterSize, bits, segmentation)), cacheFile(cachePath, histLength, cacheOptions(options))
+{
+}
+
+std::string histogramCache::cacheFilename(const std::string& directory, int filterSize, int bits, const std::string& segmentation)
+{
+    // Feature files link to the cache by absolute path, so they stay valid from any working directory
+    char resolved[PATH_MAX];
+    if (realpath(directory.c_str(), resolved) == NULL)
+    {
+        throw runtime_error("Error: histogram cache directory " + directory + " not found");
+    }
+
+    std::stringstream nameStream;
+    nameStream << resolved << "/bsif_cache_" << filterSize << "_" << bits << "_" << segmentation << ".hdf5";
+    return nameStream.str();
+}
+
+// 64-bit FNV-1a hash over the crop size and pixels
+std::string histogramCache::key(const cv::Mat& image)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int size[2] = {image.rows, image.cols};
+    const unsigned char* sizeBytes = (const unsigned char*)size;
+    for (size_t i = 0; i < sizeof(size); i++)
+    {
+        hash = (hash ^ sizeBytes[i]) * 1099511628211ULL;
+    }
+    size_t rowBytes = image.cols * image.elemSize();
+    for (int row = 0; row < image.rows; row++)
+    {
+        const unsigned char* pixels = image.ptr(row);
+        for (size_t i = 0; i < rowBytes; i++)
+        {
+            hash = (hash ^ pixels[i]) * 1099511628211ULL;
+        }
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return std::string(hex);
+}
+
+bool histogramCache::lookup(const std::string& key, std::vector<int>& histogram)
+{
+    return cacheFile.read(key, histogram);
+}
+
+void histogramCache::store(const std::string& key, const std::vector<int>& histogram, int pixelCount)
+{
+    cacheFile.write(key, histogram, pixelCount);
+}
+
+
+
+
+
+// Flat feature file
+flatFeatureWriter::flatFeatureWriter(const std::string& filename, int histLength, const extractionOptions& options) : featureWriter(filename), dataFile(NULL), journal(NULL)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, flatMagic, sizeof(flatMagic));
+    header.version = flatVersion;
+    header.dataType = options.flatType;
+    header.cols = histLength;
+    header.dataOffset = flatDataOffset;
+
+    if ((header.dataType != FLAT_FLOAT) && (header.dataType != FLAT_UINT16))
+    {
+        throw runtime_error("Error: invalid flat feature type");
+    }
+
+    ifstream existingFile(filename);
+    if (options.incremental && existingFile.good())
+    {
+        existingFile.close();
+        resume(histLength);
+    }
+    else
+    {
+        create();
+    }
+
+    rowFloat.resize(histLength, 0);
+    rowCounts.resize(histLength, 0);
+}
+
+void flatFeatureWriter::create(void)
+{
+    dataFile = fopen(path.c_str(), "wb+");
+    journal = fopen((path + ".names").c_str(), "w");
+    if ((dataFile == NULL) || (journal == NULL))
+    {
+        throw runtime_error("Error: unable to create feature file " + path);
+    }
+    std::vector<char> padding(flatDataOffset, 0);
+    memcpy(&padding[0], &header, sizeof(header));
+    fwrite(&padding[0], 1, padding.size(), dataFile);
+}
+
+// Reopens an existing file for appending: complete files are read through their name table,
+// interrupted ones through the journal, keeping only rows that were fully written
+void flatFeatureWriter::resume(int histLength)
+{
+    std::string journalName = path + ".names";
+    size_t rowBytes = histLength * (header.dataType == FLAT_FLOAT ? sizeof(float) : sizeof(unsigned short));
+
+    ifstream journalIn(journalName);
+    if (journalIn.good() && (bytesOnDisk() < flatDataOffset))
+    {
+        // Interrupted before the header and its padding reached the disk: no rows to keep, start over
+        journalIn.close();
+        create();
+        return;
+    }
+
+    if (journalIn.good())
+    {
+        // Interrupted: names up to the last checkpoint are in the journal
+        flatFeatureHeader stored;
+        FILE* existing = fopen(path.c_str(), "rb");
+        if ((existing == NULL) || (fread(&stored, sizeof(stored), 1, existing) != 1) || (memcmp(stored.magic, flatMagic, sizeof(flatMagic)) != 0))
+        {
+            if (existing != NULL) fclose(existing);
+            throw runtime_error("Error: unable to reopen feature file " + path + " for incremental extraction.");
+        }
+        fclose(existing);
+
+        if ((stored.cols != header.cols) || (stored.dataType != header.dataType))
+        {
+            throw runtime_error("Error: feature file " + path + " was written with a different bit size or type.");
+        }
+
+        std::string currentName;
+        while (getline(journalIn, currentName))
+        {
+            names.push_back(currentName);
+        }
+        journalIn.close();
+
+        size_t rowsOnDisk = (bytesOnDisk() - flatDataOffset) / rowBytes;
+        if (names.size() > rowsOnDisk)
+        {
+            names.resize(rowsOnDisk);
+        }
+    }
+    else
+    {
+        // Complete: take the names from the name table
+        flatFeatureFile existing(path);
+        if ((existing.cols() != histLength) || (existing.dataType() != (int)header.dataType))
+        {
+            throw runtime_error("Error: feature file " + path + " was written with a different bit size or type.");
+        }
+        for (int i = 0; i < existing.rows(); i++)
+        {
+            names.push_back(existing.name(i));
+        }
+    }
+
+    // Drop everything after the last complete row (partial rows or the old name table)
+    if (truncate(path.c_str(), flatDataOffset + names.size() * rowBytes) != 0)
+    {
+        throw runtime_error("Error: unable to reopen feature file " + path + " for incremental extraction.");
+    }
+
+    dataFile = fopen(path.c_str(), "rb+");
+    journal = fopen(journalName.c_str(), "w");
+    if ((dataFile == NULL) || (journal == NULL))
+    {
+        throw runtime_error("Error: unable to reopen feature file " + path + " for incremental extraction.");
+    }
+    fseek(dataFile, 0, SEEK_END);
+
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        nameSet.insert(names[i]);
+        fprintf(journal, "%s\n", names[i].c_str());
+    }
+    fflush(journal);
+    numImages = (int)names.size();
+}
+
+flatFeatureWriter::~flatFeatureWriter()
+{
+    close();
+}
+
+bool flatFeatureWriter::has(const std::string& name)
+{
+    return nameSet.count(name) > 0;
+}
+
+void flatFeatureWriter::write(const std::string& name, const std::vector<int>& histogram, int pixelCount)
+{
+    if (header.dataType == FLAT_FLOAT)
+    {
+        // Stored normalized, so loading needs no further processing
+        std::copy(histogram.begin() + 1, histogram.end(), rowFloat.begin()); // skip zero slot
+        normalizeFeatures(cv::Mat(1, (int)rowFloat.size(), CV_32FC1, &rowFloat[0]));
+        writeRow(name, &rowFloat[0]);
+    }
+    else
+    {
+        if (pixelCount > USHRT_MAX)
+        {
+            throw runtime_error("Error: histogram counts of " + name + " do not fit in uint16 flat feature files, use float instead.");
+        }
+        std::copy(histogram.begin() + 1, histogram.end(), rowCounts.begin()); // skip zero slot
+        writeRow(name, &rowCounts[0]);
+    }
+}
+
+void flatFeatureWriter::writeRow(const std::string& name, const void* row)
+{
+    size_t elementSize = (header.dataType == FLAT_FLOAT) ? sizeof(float) : sizeof(unsigned short);
+    if (fwrite(row, elementSize, header.cols, dataFile) != header.cols)
+    {
+        throw runtime_error("Error: unable to store features of " + name + " in " + path);
+    }
+
+    names.push_back(name);
+    nameSet.insert(name);
+    fprintf(journal, "%s\n", name.c_str());
+    numImages++;
+}
+
+void flatFeatureWriter::merge(const std::string& shardFile, const std::vector<std::string>& names)
+{
+    flatFeatureFile shard(shardFile);
+    if ((shard.cols() != (int)header.cols) || (shard.dataType() != (int)header.dataType))
+    {
+        throw runtime_error("Error: shard feature file " + shardFile + " was written with a different bit size or type.");
+    }
+
+    // Rows are copied as stored
+    cv::Mat rows = shard.matrix();
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        int row = shard.find(names[i]);
+        if (row < 0)
+        {
+            throw runtime_error("Error: features of " + names[i] + " missing from shard feature file " + shardFile);
+        }
+        if (has(names[i]))
+        {
+            throw runtime_error("Error: features of " + names[i] + " found in more than one shard");
+        }
+        writeRow(names[i], rows.ptr(row));
+    }
+}
+
+void flatFeatureWriter::checkpoint()
+{
+    // Rows first: the journal never names a row that is not on disk
+    fflush(dataFile);
+    fsync(fileno(dataFile));
+    fflush(journal);
+    fsync(fileno(journal));
+}
+
+void flatFeatureWriter::close()
+{
+    if (dataFile == NULL)
+    {
+        return;
+    }
+
+    // Name table after the matrix
+    fflush(dataFile);
+    fseek(dataFile, 0, SEEK_END);
+    header.rows = names.size();
+    header.namesOffset = ftell(dataFile);
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        uint32_t length = (uint32_t)names[i].size();
+        fwrite(&length, sizeof(length), 1, dataFile);
+        fwrite(names[i].data(), 1, length, dataFile);
+    }
+    header.namesSize = ftell(dataFile) - header.namesOffset;
+
+    // Final header
+    fseek(dataFile, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, dataFile);
+    fclose(dataFile);
+    dataFile = NULL;
+
+    // The file is complete, the journal is no longer needed
+    fclose(journal);
+    journal = NULL;
+    remove((path + ".names").c_str());
+}
+
+
+
+
+
+// Memory-mapped flat feature file
+flatFeatureFile::flatFeatureFile(const std::string& filename) : path(filename), mapping(MAP_FAILED), mappingSize(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Error: no features found in " + filename);
+    }
+
+    struct stat fileInfo;
+    if ((fstat(fd, &fileInfo) != 0) || ((size_t)fileInfo.st_size < flatDataOffset))
+    {
+        ::close(fd);
+        throw runtime_error("Error: invalid feature file " + filename);
+    }
+    mappingSize = fileInfo.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        throw runtime_error("Error: unable to map feature file " + filename);
+    }
+
+    // Validate header
+    memcpy(&header, mapping, sizeof(header));
+    size_t elementSize = (header.dataType == FLAT_FLOAT) ? sizeof(float) : sizeof(unsigned short);
+    if ((memcmp(header.magic, flatMagic, sizeof(flatMagic)) != 0) || (header.version != flatVersion) ||
+        ((header.dataType != FLAT_FLOAT) && (header.dataType != FLAT_UINT16)) ||
+        (header.dataOffset + header.rows * header.cols * elementSize > header.namesOffset) ||
+        (header.namesOffset + header.namesSize > mappingSize))
+    {
+        munmap(mapping, mappingSize);
+        mapping = MAP_FAILED;
+        throw runtime_error("Error: invalid or incomplete feature file " + filename);
+    }
+
+    // Read name table
+    const char* table = (const char*)mapping + header.namesOffset;
+    const char* tableEnd = table + header.namesSize;
+    names.reserve(header.rows);
+    for (uint64_t i = 0; i < header.rows; i++)
+    {
+        uint32_t length;
+        if (table + sizeof(length) > tableEnd)
+        {
+            break;
+        }
+        memcpy(&length, table, sizeof(length));
+        table += sizeof(length);
+        if (table + length > tableEnd)
+        {
+            break;
+        }
+        names.push_back(std::string(table, length));
+        rowOf[names.back()] = (int)i;
+        table += length;
+    }
+
+    if (names.size() != header.rows)
+    {
+        munmap(mapping, mappingSize);
+        mapping = MAP_FAILED;
+        throw runtime_error("Error: invalid name table in feature file " + filename);
+    }
+}
+
+flatFeatureFile::~flatFeatureFile()
+{
+    if (mapping != MAP_FAILED)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+int flatFeatureFile::find(const std::string& name) const
+{
+    std::unordered_map<std::string, int>::const_iterator it = rowOf.find(name);
+    return (it == rowOf.end()) ? -1 : it->second;
+}
+
+cv::Mat flatFeatureFile::matrix(void) const
+{
+    int type = (header.dataType == FLAT_FLOAT) ? CV_32FC1 : CV_16UC1;
+    return cv::Mat((int)header.rows, (int)header.cols, type, (char*)mapping + header.dataOffset);
+}
+
+std::vector<int> flatFeatureFile::locate(const std::vector<std::string>& imageNames, bool& consecutive) const
+{
+    std::vector<int> rowIndex(imageNames.size());
+    consecutive = true;
+    for (int i = 0; i < (int)imageNames.size(); i++)
+    {
+        rowIndex[i] = find(imageNames[i]);
+        if (rowIndex[i] < 0)
+        {
+            throw runtime_error("Error: features for " + imageNames[i] + " not found in " + path);
+        }
+        consecutive = consecutive && ((i == 0) || (rowIndex[i] == rowIndex[i - 1] + 1));
+    }
+    return rowIndex;
+}
+
+cv::Mat flatFeatureFile::features(const std::vector<std::string>& imageNames) const
+{
+    // Locate each image
+    bool consecutive;
+    std::vector<int> rowIndex = locate(imageNames, consecutive);
+
+    cv::Mat stored = matrix();
+
+    // Zero copy: the list is a block of normalized rows (e.g. the training or testing part of an extraction)
+    if (consecutive && (header.dataType == FLAT_FLOAT) && (! imageNames.empty()))
+    {
+        return stored.rowRange(rowIndex[0], rowIndex[0] + (int)imageNames.size());
+    }
+
+    // Otherwise gather the rows, normalizing raw counts
+    cv::Mat gathered((int)imageNames.size(), (int)header.cols, CV_32FC1);
+    for (int i = 0; i < (int)imageNames.size(); i++)
+    {
+        stored.row(rowIndex[i]).convertTo(gathered.row(i), CV_32FC1);
+        if (header.dataType == FLAT_UINT16)
+        {
+            normalizeFeatures(gathered.row(i));
+        }
+    }
+    return gathered;
+}
+
+cv::Mat flatFeatureFile::counts(const std::vector<std::string>& imageNames) const
+{
+    if (header.dataType != FLAT_UINT16)
+    {
+        return cv::Mat();
+    }
+
+    bool consecutive;
+    std::vector<int> rowIndex = locate(imageNames, consecutive);
+
+    cv::Mat stored = matrix();
+    if (consecutive && (! imageNames.empty()))
+    {
+        return stored.rowRange(rowIndex[0], rowIndex[0] + (int)imageNames.size());
+    }
+
+    cv::Mat gathered((int)imageNames.size(), (int)header.cols, CV_16UC1);
+    for (int i = 0; i < (int)imageNames.size(); i++)
+    {
+        stored.row(rowIndex[i]).copyTo(gathered.row(i));
+    }
+    return gathered;
+}
+
+
+
+
+
+// Feature streams
+featureStream::featureStream(const std::string& filename, const std::string& format, const std::vector<std::string>& imageNames, int histLength) : path(filename), names(imageNames), length(histLength)
+{
+    if (format == FORMAT_FLAT)
+    {
+        flat.reset(new flatFeatureFile(filename));
+        if (flat->cols() != histLength)
+        {
+            throw runtime_error("Error: unexpected number of features in " + filename);
+        }
+    }
+}
+
+cv::Mat featureStream::batch(int first, int last) const
+{
+    std::vector<std::string> batchNames(names.begin() + first, names.begin() + last);
+    if (flat)
+    {
+        return flat->features(batchNames);
+    }
+    return loadHDF5Features(path, batchNames, length);
+}
+
+
+
+
+
+// Normalized feature snapshots
+uint64_t splitHash(const std::vector<std::string>& names, const std::vector<int>& classes)
+{
+    // 64-bit FNV-1a over "name,class\n" lines
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        std::string line = names[i] + "," + std::to_string((i < classes.size()) ? classes[i] : -1) + "\n";
+        for (size_t c = 0; c < line.size(); c++)
+        {
+            hash = (hash ^ (unsigned char)line[c]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Size and modification time of the feature file a snapshot depends on
+static bool sourceIdentity(const std::string& featureFile, uint64_t& size, int64_t& time)
+{
+    struct stat fileInfo;
+    if (stat(featureFile.c_str(), &fileInfo) != 0)
+    {
+        return false;
+    }
+    size = fileInfo.st_size;
+    time = fileInfo.st_mtime;
+    return true;
+}
+
+void writeFeatureSnapshot(const std::string& filename, const std::string& featureFile, uint64_t splitId, const cv::Mat& features, const cv::Mat& labels)
+{
+    featureSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.rows = features.rows;
+    header.cols = features.cols;
+    header.splitHash = splitId;
+    header.dataOffset = flatDataOffset;
+    if ((features.type() != CV_32FC1) || (labels.rows != features.rows) || ! sourceIdentity(featureFile, header.sourceSize, header.sourceTime))
+    {
+        throw runtime_error("Error: unable to snapshot the features of " + featureFile);
+    }
+
+    std::string tempName = filename + ".tmp";
+    FILE* file = fopen(tempName.c_str(), "wb");
+    if (file == NULL)
+    {
+        throw runtime_error("Error: unable to write feature snapshot " + filename);
+    }
+
+    std::vector<char> padding(header.dataOffset - sizeof(header), 0);
+    bool written = (fwrite(&header, sizeof(header), 1, file) == 1) && (fwrite(&padding[0], 1, padding.size(), file) == padding.size());
+    for (int i = 0; written && (i < features.rows); i++)
+    {
+        written = (fwrite(features.ptr<float>(i), sizeof(float), features.cols, file) == (size_t)features.cols);
+    }
+    for (int i = 0; written && (i < labels.rows); i++)
+    {
+        written = (fwrite(labels.ptr<int>(i), sizeof(int), 1, file) == 1);
+    }
+    written = (fclose(file) == 0) && written;
+
+    if (! written || (rename(tempName.c_str(), filename.c_str()) != 0))
+    {
+        remove(tempName.c_str());
+        throw runtime_error("Error: unable to write feature snapshot " + filename);
+    }
+}
+
+bool readFeatureSnapshot(const std::string& filename, const std::string& featureFile, uint64_t splitId, cv::Mat& features, cv::Mat& labels)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    // Only a snapshot of this feature file, as it is now, and of this split
+    featureSnapshotHeader header;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    bool valid = (fread(&header, sizeof(header), 1, file) == 1) && (memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) == 0) &&
+                 (header.version == snapshotVersion) && (header.splitHash == splitId) && sourceIdentity(featureFile, sourceSize, sourceTime) &&
+                 (header.sourceSize == sourceSize) && (header.sourceTime == sourceTime) && (fseek(file, (long)header.dataOffset, SEEK_SET) == 0);
+
+    // Bulk reads straight into new matrices (the ones passed in may share their data with matrices in use)
+    if (valid)
+    {
+        cv::Mat snapshotFeatures((int)header.rows, (int)header.cols, CV_32FC1);
+        cv::Mat snapshotLabels((int)header.rows, 1, CV_32SC1);
+        valid = (header.rows == 0) || ((fread(snapshotFeatures.ptr<float>(0), sizeof(float) * header.cols, header.rows, file) == header.rows) &&
+                                       (fread(snapshotLabels.ptr<int>(0), sizeof(int), header.rows, file) == header.rows));
+        if (valid)
+        {
+            features = snapshotFeatures;
+            labels = snapshotLabels;
+        }
+    }
+    fclose(file);
+
+    return valid;
+}
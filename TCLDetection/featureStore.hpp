@@ -0,0 +1,381 @@
+//
+//  featureStore.hpp
+//  TCLDetection
+
+
+
+#ifndef featureStore_hpp
+#define featureStore_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <opencv2/core/core.hpp>
+#include "hdf5.h"
+
+
+// Feature file formats
+#define FORMAT_HDF5 "hdf5"
+#define FORMAT_FLAT "flat"
+
+// Element types of flat feature files
+#define FLAT_FLOAT 0    // z-score normalized float32 rows, ready to use
+#define FLAT_UINT16 1   // raw uint16 histogram counts
+
+
+// Options controlling how feature files are written
+struct extractionOptions
+{
+    // Reopen existing feature files and only extract images they do not contain yet
+    bool incremental;
+
+    // Number of newly extracted images between flushes of a feature file to disk
+    int checkpointInterval;
+
+    // Store histograms in chunked datasets with the HDF5 shuffle and deflate filters
+    bool compress;
+
+    // Deflate level (1-9) used when compressing
+    int compressionLevel;
+
+    // Feature file format (hdf5 or flat)
+    std::string format;
+
+    // Element type of flat feature files (FLAT_FLOAT or FLAT_UINT16)
+    int flatType;
+
+    // Directory of the content-addressed histogram cache (empty if disabled)
+    std::string cacheDir;
+
+    // Packed image archive to read images from instead of the image directory (empty if none)
+    std::string archiveFilename;
+
+    // Downsampling for even filter sizes: pyrDown of the full resolution image (exact), or decoder reduction / 2x2 averaging (fast)
+    bool exactDownsampling;
+
+    // Threads filtering images in parallel (0: one per core)
+    int numThreads;
+
+    // JSON file receiving the per-stage timings of the run (empty if none)
+    std::string reportFilename;
+
+    extractionOptions() : incremental(false), checkpointInterval(500), compress(false), compressionLevel(4), format(FORMAT_HDF5), flatType(FLAT_FLOAT), exactDownsampling(true), numThreads(0) {}
+};
+
+
+// Builds the name of the feature file for a BSIF size and bit size, e.g. dir/histogram_filter_5_5_8.hdf5
+std::string featureFilename(const std::string& prefix, int filterSize, int bits, const std::string& format);
+
+// Z-score normalizes a row of features in place (the normalization used for all models)
+void normalizeFeatures(cv::Mat row);
+
+// Z-score normalizes every row of a float matrix in place, rows spread over OpenCV's threads
+void normalizeFeatureRows(cv::Mat features);
+
+// Reads the histograms of a list of images from an HDF5 feature file straight into the rows of a float matrix, in list order
+// (HDF5 converts the stored counts to float on read), then normalizes them. Throws if an image has no features in the file.
+cv::Mat loadHDF5Features(const std::string& filename, const std::vector<std::string>& imageNames, int histLength);
+
+// Same, as raw uint16 counts (CV_16UC1), or an empty matrix if a count does not fit in 16 bits
+cv::Mat loadHDF5Counts(const std::string& filename, const std::vector<std::string>& imageNames, int histLength);
+
+
+// Forms of feature matrices held in memory for training and testing
+#define COMPACT_FLOAT 0     // normalized float32
+#define COMPACT_UINT16 1    // raw uint16 counts, normalized when expanded: same features as float32 in half the memory
+#define COMPACT_FLOAT16 2   // normalized float16: half the memory, features rounded to 11 significant bits
+
+// Rows expanded to float32 at a time
+#define COMPACT_BLOCK_ROWS 256
+
+// Feature matrix held in memory in a compact form, expanded to normalized float32 rows on demand, in blocks
+class compactFeatures
+{
+public:
+    compactFeatures() : storedForm(COMPACT_FLOAT) {}
+
+    // Normalized float32 features, kept as they are (COMPACT_FLOAT) or rounded to COMPACT_FLOAT16
+    compactFeatures(const cv::Mat& normalized, int compactForm);
+
+    // Raw counts (CV_16UC1), normalized when expanded
+    static compactFeatures fromCounts(const cv::Mat& counts);
+
+    int rows(void) const { return data.rows; }
+    int cols(void) const { return data.cols; }
+    int form(void) const { return storedForm; }
+    size_t bytes(void) const { return data.total() * data.elemSize(); }
+
+    // Normalized float32 rows first to last - 1 (wrapping the stored rows when they are float32)
+    cv::Mat block(int first, int last) const;
+
+    // All rows as normalized float32 (the stored matrix itself when float32), expanded in parallel
+    cv::Mat toFloat(void) const;
+
+private:
+    cv::Mat data;
+    int storedForm;
+};
+
+
+// Sharded extraction: shard k of N writes its feature files under prefix_shard_k_of_N and, once they are complete,
+// a manifest (prefix_shard_k_of_N.manifest) listing its images. Merging combines the shard files into the final feature files.
+std::string shardPrefix(const std::string& prefix, int shard, int numShards);
+
+// Writes the manifest of a completed shard
+void writeShardManifest(const std::string& prefix, int shard, int numShards, const std::vector<std::string>& names);
+
+// Reads the images of a shard from its manifest, returns false if the shard has not completed
+bool readShardManifest(const std::string& prefix, int shard, int numShards, std::vector<std::string>& names);
+
+
+// Destination of the histograms produced by feature extraction
+class featureWriter
+{
+public:
+    featureWriter(const std::string& filename);
+    virtual ~featureWriter() {}
+
+    // Returns true if the file already holds complete features for an image
+    virtual bool has(const std::string& name) = 0;
+
+    // Stores the histogram of an image (position 0 of the histogram is unused)
+    virtual void write(const std::string& name, const std::vector<int>& histogram, int pixelCount) = 0;
+
+    // Stores a histogram that is also held by a histogram cache; formats that can reference it do so instead of copying
+    virtual void writeCached(const std::string& name, const std::vector<int>& histogram, int pixelCount, const std::string& cacheFile, const std::string& key);
+
+    // Makes everything written so far survive a crash
+    virtual void checkpoint() = 0;
+
+    // Finalizes and closes the file
+    virtual void close() = 0;
+
+    // Copies the features of images from a shard feature file of the same format, throws if one is missing or already present
+    virtual void merge(const std::string& shardFile, const std::vector<std::string>& names) = 0;
+
+    // Number of images in the file
+    int imageCount(void) { return numImages; }
+
+    // Size of the file on disk
+    unsigned long long bytesOnDisk(void);
+
+protected:
+    std::string path;
+    int numImages;
+};
+
+// Opens a writer for the format in the options
+std::unique_ptr<featureWriter> openFeatureWriter(const std::string& filename, int histLength, const extractionOptions& options);
+
+
+// HDF5 feature file: one dataset of counts per image, named after the image
+class hdf5FeatureWriter : public featureWriter
+{
+public:
+    hdf5FeatureWriter(const std::string& filename, int histLength, const extractionOptions& options);
+    ~hdf5FeatureWriter();
+
+    bool has(const std::string& name);
+    void write(const std::string& name, const std::vector<int>& histogram, int pixelCount);
+    void writeCached(const std::string& name, const std::vector<int>& histogram, int pixelCount, const std::string& cacheFile, const std::string& key);
+    void checkpoint();
+    void close();
+    void merge(const std::string& shardFile, const std::vector<std::string>& names);
+
+    // Reads the histogram of an image into positions 1..n, returns false if the file has none
+    bool read(const std::string& name, std::vector<int>& histogram);
+
+private:
+    hid_t file_id;
+    hid_t dataspace_id;
+    hid_t dcpl_id;
+    hsize_t dims[1];
+
+    // Narrow copies of the histogram matching the type stored in the file
+    std::vector<unsigned short> counts16;
+    std::vector<unsigned int> counts32;
+};
+
+
+// Content-addressed histogram cache: histograms keyed by a hash of the decoded image crop, in one HDF5 file
+// per BSIF size, bit size and segmentation (cacheDir/bsif_cache_size_bits_segmentation.hdf5).
+// HDF5 feature files reference cached histograms through external links, so each is stored once
+// no matter how many feature files or splits contain the image.
+class histogramCache
+{
+public:
+    histogramCache(const std::string& directory, int filterSize, int bits, const std::string& segmentation, int histLength, const extractionOptions& options);
+
+    // Hash of the pixels of an image crop
+    static std::string key(const cv::Mat& image);
+
+    // Fills positions 1..n of the histogram if the cache holds it
+    bool lookup(const std::string& key, std::vector<int>& histogram);
+
+    // True if the cache holds a histogram for the key
+    bool contains(const std::string& key) { return cacheFile.has(key); }
+
+    // Adds a histogram to the cache
+    void store(const std::string& key, const std::vector<int>& histogram, int pixelCount);
+
+    void checkpoint() { cacheFile.checkpoint(); }
+    void close() { cacheFile.close(); }
+
+    // Absolute path of the cache file
+    const std::string& filename(void) const { return cachePath; }
+
+private:
+    std::string cachePath;
+    hdf5FeatureWriter cacheFile;
+
+    static std::string cacheFilename(const std::string& directory, int filterSize, int bits, const std::string& segmentation);
+};
+
+
+// Flat feature file: a fixed header, a page-aligned row-major matrix and a table of image names
+//
+// [header (64 bytes)][padding to dataOffset][rows x cols elements][name table: per row, uint32 length + characters]
+//
+// While the file is being written, the names are journaled to filename.names and the name table is only
+// written on close, so an interrupted file can be recovered by reopening it incrementally.
+struct flatFeatureHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dataType;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t dataOffset;
+    uint64_t namesOffset;
+    uint64_t namesSize;
+    uint64_t reserved;
+};
+
+class flatFeatureWriter : public featureWriter
+{
+public:
+    flatFeatureWriter(const std::string& filename, int histLength, const extractionOptions& options);
+    ~flatFeatureWriter();
+
+    bool has(const std::string& name);
+    void write(const std::string& name, const std::vector<int>& histogram, int pixelCount);
+    void checkpoint();
+    void close();
+    void merge(const std::string& shardFile, const std::vector<std::string>& names);
+
+private:
+    FILE* dataFile;
+    FILE* journal;
+    flatFeatureHeader header;
+    std::vector<std::string> names;
+    std::unordered_set<std::string> nameSet;
+
+    // One row in the type stored in the file
+    std::vector<float> rowFloat;
+    std::vector<unsigned short> rowCounts;
+
+    // Starts a new file: header, padding up to the matrix, empty journal
+    void create(void);
+
+    void resume(int histLength);
+
+    // Appends a row already in the type stored in the file
+    void writeRow(const std::string& name, const void* row);
+};
+
+
+// Read-only, memory-mapped view of a flat feature file
+class flatFeatureFile
+{
+public:
+    flatFeatureFile(const std::string& filename);
+    ~flatFeatureFile();
+
+    int rows(void) const { return (int)header.rows; }
+    int cols(void) const { return (int)header.cols; }
+    int dataType(void) const { return (int)header.dataType; }
+
+    // Row of an image, or -1 if the file has no features for it
+    int find(const std::string& name) const;
+
+    // Name of the image in a row
+    const std::string& name(int row) const { return names[row]; }
+
+    // The whole matrix, wrapping the mapped file without copying (CV_32FC1 or CV_16UC1)
+    cv::Mat matrix(void) const;
+
+    // Normalized float features for a list of images, in list order.
+    // Wraps the mapped file when the images are stored consecutively as normalized floats, copies otherwise.
+    cv::Mat features(const std::vector<std::string>& imageNames) const;
+
+    // Raw uint16 counts for a list of images, in list order (wrapping the mapped file when consecutive),
+    // or an empty matrix if the file holds normalized floats
+    cv::Mat counts(const std::vector<std::string>& imageNames) const;
+
+private:
+    std::string path;
+    flatFeatureHeader header;
+    void* mapping;
+    size_t mappingSize;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int> rowOf;
+
+    // Rows of a list of images, throws if one is missing; tells if the rows follow each other
+    std::vector<int> locate(const std::vector<std::string>& imageNames, bool& consecutive) const;
+};
+
+
+// Normalized features of a list of images, read a batch of rows at a time (from an HDF5 or flat feature file),
+// for models trained or applied out of core: only the batch being used is held in memory
+class featureStream
+{
+public:
+    featureStream(const std::string& filename, const std::string& format, const std::vector<std::string>& imageNames, int histLength);
+
+    int rows(void) const { return (int)names.size(); }
+    int cols(void) const { return length; }
+
+    // Normalized float features of the images first to last - 1 of the list
+    // (wrapping the mapped flat file when those rows are stored consecutively as normalized floats)
+    cv::Mat batch(int first, int last) const;
+
+private:
+    std::string path;
+    std::vector<std::string> names;
+    int length;
+    std::unique_ptr<flatFeatureFile> flat;
+};
+
+
+// Normalized feature snapshot: the float feature matrix and labels of one split, as loaded for training or testing,
+// with the identity of the feature file and split they were built from, so a stale snapshot is never used
+//
+// [header (64 bytes)][padding to dataOffset][rows x cols float32 features][rows int32 labels]
+struct featureSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t sourceSize;    // size of the feature file
+    int64_t sourceTime;     // modification time of the feature file
+    uint64_t splitHash;     // splitHash() of the split
+    uint64_t dataOffset;
+};
+
+// Identity of a split: hash of its image names and classes, in list order
+uint64_t splitHash(const std::vector<std::string>& names, const std::vector<int>& classes);
+
+// Writes a snapshot (to a temporary file renamed into place, so readers never see a partial one)
+void writeFeatureSnapshot(const std::string& filename, const std::string& featureFile, uint64_t splitId, const cv::Mat& features, const cv::Mat& labels);
+
+// Reads a snapshot into new matrices, returns false if there is none or it was built from another feature file or split
+bool readFeatureSnapshot(const std::string& filename, const std::string& featureFile, uint64_t splitId, cv::Mat& features, cv::Mat& labels);
+
+#endif /* featureStore_hpp */
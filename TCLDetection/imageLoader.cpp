@@ -0,0 +1,566 @@
+//
+//  imageLoader.cpp
+//  TCLDetection
+
+
+
+#include "imageLoader.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+
+using namespace std;
+
+static const char archiveMagic[8] = {'T', 'C', 'L', 'P', 'A', 'C', 'K', '\0'};
+static const uint32_t archiveVersion = 1;
+
+
+// Packed image archive
+imageArchive::imageArchive(const std::string& filename) : path(filename), mapping(MAP_FAILED), mappingSize(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Error: image archive " + filename + " not found");
+    }
+
+    struct stat fileInfo;
+    if ((fstat(fd, &fileInfo) != 0) || ((size_t)fileInfo.st_size < sizeof(imageArchiveHeader)))
+    {
+        ::close(fd);
+        throw runtime_error("Error: invalid image archive " + filename);
+    }
+    mappingSize = fileInfo.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        throw runtime_error("Error: unable to map image archive " + filename);
+    }
+
+    // Images are read in about the order they were packed
+    madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+    // Validate header
+    imageArchiveHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    if ((memcmp(header.magic, archiveMagic, sizeof(archiveMagic)) != 0) || (header.version != archiveVersion) ||
+        (header.indexOffset < sizeof(header)) || (header.indexOffset > mappingSize))
+    {
+        munmap(mapping, mappingSize);
+        mapping = MAP_FAILED;
+        throw runtime_error("Error: invalid or incomplete image archive " + filename);
+    }
+
+    // Read index
+    const char* table = (const char*)mapping + header.indexOffset;
+    const char* tableEnd = (const char*)mapping + mappingSize;
+    index.reserve(header.count);
+    for (uint64_t i = 0; i < header.count; i++)
+    {
+        uint32_t length;
+        uint64_t offset, size;
+        if (table + sizeof(length) > tableEnd)
+        {
+            break;
+        }
+        memcpy(&length, table, sizeof(length));
+        table += sizeof(length);
+        if (table + length + sizeof(offset) + sizeof(size) > tableEnd)
+        {
+            break;
+        }
+        std::string name(table, length);
+        table += length;
+        memcpy(&offset, table, sizeof(offset));
+        table += sizeof(offset);
+        memcpy(&size, table, sizeof(size));
+        table += sizeof(size);
+        if ((offset < sizeof(header)) || (offset + size > header.indexOffset))
+        {
+            break;
+        }
+        index[name] = std::make_pair(offset, size);
+    }
+
+    if (index.size() != header.count)
+    {
+        munmap(mapping, mappingSize);
+        mapping = MAP_FAILED;
+        throw runtime_error("Error: invalid index in image archive " + filename);
+    }
+}
+
+imageArchive::~imageArchive()
+{
+    if (mapping != MAP_FAILED)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+bool imageArchive::find(const std::string& name, const unsigned char*& data, size_t& length) const
+{
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t> >::const_iterator it = index.find(name);
+    if (it == index.end())
+    {
+        return false;
+    }
+    data = (const unsigned char*)mapping + it->second.first;
+    length = it->second.second;
+    return true;
+}
+
+void imageArchive::pack(const std::string& filename, const std::vector<std::pair<std::string, std::string> >& files)
+{
+    std::ofstream out(filename, std::ofstream::binary);
+    if (! out.good())
+    {
+        throw runtime_error("Error: unable to create image archive " + filename);
+    }
+
+    imageArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, archiveMagic, sizeof(archiveMagic));
+    header.version = archiveVersion;
+    out.write((const char*)&header, sizeof(header));
+
+    // Contents, each file copied as is
+    std::vector<uint64_t> offsets, sizes;
+    uint64_t offset = sizeof(header);
+    std::vector<char> buffer;
+    for (int i = 0; i < (int)files.size(); i++)
+    {
+        std::ifstream in(files[i].second, std::ifstream::binary | std::ifstream::ate);
+        if (! in.good())
+        {
+            throw runtime_error("Error: unable to read " + files[i].second + " for packing");
+        }
+        buffer.resize((size_t)in.tellg());
+        in.seekg(0);
+        in.read(buffer.data(), buffer.size());
+        out.write(buffer.data(), buffer.size());
+
+        offsets.push_back(offset);
+        sizes.push_back(buffer.size());
+        offset += buffer.size();
+    }
+
+    // Index
+    for (int i = 0; i < (int)files.size(); i++)
+    {
+        uint32_t length = (uint32_t)files[i].first.size();
+        out.write((const char*)&length, sizeof(length));
+        out.write(files[i].first.data(), length);
+        out.write((const char*)&offsets[i], sizeof(offsets[i]));
+        out.write((const char*)&sizes[i], sizeof(sizes[i]));
+    }
+
+    // The header goes last, so an interrupted archive is never taken for a complete one
+    header.count = files.size();
+    header.indexOffset = offset;
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    out.close();
+
+    if (out.fail())
+    {
+        throw runtime_error("Error: unable to write image archive " + filename);
+    }
+}
+
+
+
+
+
+// Image loader
+imageLoader::imageLoader(const std::string& imageDir, const std::string& segmentationType, bool exactDownsampling, const std::string& archiveFilename, stageProfile* stageTimes) : partialDecodes(0), fullDecodes(0), imageLocation(imageDir), segmentation(segmentationType), exact(exactDownsampling), profile(stageTimes)
+{
+    if ((segmentation != "wi") && (segmentation != "bg"))
+    {
+        throw runtime_error("Error: invalid segmentation type " + segmentation);
+    }
+
+    if (! archiveFilename.empty())
+    {
+        archive.reset(new imageArchive(archiveFilename));
+    }
+
+#ifdef HAVE_LIBTIFF
+    // Unknown tags and the like are not our concern, unreadable files fall back to OpenCV
+    TIFFSetWarningHandler(NULL);
+    TIFFSetErrorHandler(NULL);
+#endif
+}
+
+
+cv::Mat imageLoader::load(const std::string& filename)
+{
+    cv::Rect region(BG_X, BG_Y, BG_SIZE, BG_SIZE);
+
+    // Best guess segmentation of a TIFF: only decode the box
+    cv::Mat image;
+    if (segmentation == "bg")
+    {
+        stageTimer decodeTimer(profile, STAGE_DECODE);
+        if (loadTiffRegion(filename, region, image))
+        {
+            partialDecodes++;
+            return image;
+        }
+    }
+
+    // Load image from file
+    image = decode(filename, cv::IMREAD_GRAYSCALE);
+
+    // Segmentation
+    if (segmentation == "bg")
+    {
+        stageTimer cropTimer(profile, STAGE_CROP);
+        return image(region);
+    }
+    return image;
+}
+
+
+cv::Mat imageLoader::loadHalf(const std::string& filename)
+{
+    cv::Rect region(BG_X, BG_Y, BG_SIZE, BG_SIZE);
+
+    if (exact)
+    {
+        return halve(load(filename));
+    }
+
+    // Best guess segmentation of a TIFF: average the decoded box
+    cv::Mat image;
+    if (segmentation == "bg")
+    {
+        stageTimer decodeTimer(profile, STAGE_DECODE);
+        if (loadTiffRegion(filename, region, image))
+        {
+            partialDecodes++;
+            decodeTimer.stop();
+            return halve(image);
+        }
+    }
+
+    // Let the decoder reduce the resolution (JPEG decodes at half scale directly, other formats are resized after decoding)
+    image = decode(filename, cv::IMREAD_REDUCED_GRAYSCALE_2);
+
+    // Segmentation (box at half resolution)
+    if (segmentation == "bg")
+    {
+        stageTimer cropTimer(profile, STAGE_CROP);
+        return image(cv::Rect(BG_X / 2, BG_Y / 2, BG_SIZE / 2, BG_SIZE / 2));
+    }
+    return image;
+}
+
+
+cv::Mat imageLoader::decode(const std::string& filename, int flags)
+{
+    // Read the encoded bytes: from the mapped archive, or the whole file into memory
+    stageTimer readTimer(profile, STAGE_READ);
+    const unsigned char* data = NULL;
+    size_t length = 0;
+    std::vector<unsigned char> bytes;
+    if (archive)
+    {
+        archive->find(filename, data, length);
+    }
+    else
+    {
+        std::ifstream file(imageLocation + filename, std::ifstream::binary | std::ifstream::ate);
+        if (file.good())
+        {
+            bytes.resize((size_t)file.tellg());
+            file.seekg(0);
+            if (! bytes.empty() && file.read((char*)&bytes[0], bytes.size()))
+            {
+                data = &bytes[0];
+                length = bytes.size();
+            }
+        }
+    }
+    readTimer.stop();
+
+    // Decode from memory
+    cv::Mat image;
+    if (length > 0)
+    {
+        stageTimer decodeTimer(profile, STAGE_DECODE);
+        image = cv::imdecode(cv::Mat(1, (int)length, CV_8UC1, (void*)data), flags);
+    }
+
+    if ( image.empty() )
+    {
+        throw runtime_error("Error: unable to read image " + filename + " for feature extraction.");
+    }
+    fullDecodes++;
+    return image;
+}
+
+
+cv::Mat imageLoader::halve(const cv::Mat& image)
+{
+    stageTimer downsampleTimer(profile, STAGE_DOWNSAMPLE);
+    cv::Mat half;
+    if (exact)
+    {
+        cv::pyrDown(image, half, cv::Size(image.cols / 2, image.rows / 2));
+    }
+    else
+    {
+        cv::resize(image, half, cv::Size(image.cols / 2, image.rows / 2), 0, 0, cv::INTER_AREA);
+    }
+    return half;
+}
+
+
+imagePyramid::imagePyramid(imageLoader& imageSource, const std::string& filename, int finestOctave) : loader(imageSource), name(filename), finest(finestOctave) {}
+
+
+cv::Mat imagePyramid::level(int octave)
+{
+    // Threads needing a level being computed wait for it instead of computing it again
+    std::lock_guard<std::mutex> guard(lock);
+    return build(octave);
+}
+
+
+cv::Mat imagePyramid::build(int octave)
+{
+    if (octave >= (int)levels.size())
+    {
+        levels.resize(octave + 1);
+    }
+
+    if (levels[octave].empty())
+    {
+        if (octave == 0)
+        {
+            levels[0] = loader.load(name);
+        }
+        else if ((octave == 1) && ((levels[0].empty() && (finest >= 1)) || ! loader.exactDownsampling()))
+        {
+            // Full resolution not needed: let the loader produce the half resolution image directly
+            // Fast downsampling always does, even when the full resolution image was decoded for other sets: halving it would
+            // give other pixels, and the features of an image would depend on the other sizes extracted with it
+            levels[1] = loader.loadHalf(name);
+        }
+        else
+        {
+            levels[octave] = loader.halve(build(octave - 1));
+        }
+    }
+    return levels[octave];
+}
+
+
+#ifdef HAVE_LIBTIFF
+
+// libtiff client procedures reading a TIFF held in memory (an archive entry)
+struct tiffMemory
+{
+    const unsigned char* data;
+    toff_t size;
+    toff_t position;
+};
+
+static tmsize_t tiffMemoryRead(thandle_t handle, void* buffer, tmsize_t size)
+{
+    tiffMemory* memory = (tiffMemory*)handle;
+    tmsize_t available = (memory->position < memory->size) ? (tmsize_t)(memory->size - memory->position) : 0;
+    size = std::min(size, available);
+    memcpy(buffer, memory->data + memory->position, size);
+    memory->position += size;
+    return size;
+}
+
+static tmsize_t tiffMemoryWrite(thandle_t /*handle*/, void* /*buffer*/, tmsize_t /*size*/)
+{
+    return 0;
+}
+
+static toff_t tiffMemorySeek(thandle_t handle, toff_t offset, int whence)
+{
+    tiffMemory* memory = (tiffMemory*)handle;
+    if (whence == SEEK_CUR)
+    {
+        offset += memory->position;
+    }
+    else if (whence == SEEK_END)
+    {
+        offset += memory->size;
+    }
+    memory->position = offset;
+    return offset;
+}
+
+static int tiffMemoryClose(thandle_t /*handle*/)
+{
+    return 0;
+}
+
+static toff_t tiffMemorySize(thandle_t handle)
+{
+    return ((tiffMemory*)handle)->size;
+}
+
+// Lets libtiff read strips straight from the mapping instead of copying them
+static int tiffMemoryMap(thandle_t handle, void** base, toff_t* size)
+{
+    tiffMemory* memory = (tiffMemory*)handle;
+    *base = (void*)memory->data;
+    *size = memory->size;
+    return 1;
+}
+
+static void tiffMemoryUnmap(thandle_t /*handle*/, void* /*base*/, toff_t /*size*/)
+{
+}
+
+
+bool imageLoader::loadTiffRegion(const std::string& filename, const cv::Rect& region, cv::Mat& dst)
+{
+    // Only TIFF files
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if ((extension != "tif") && (extension != "tiff"))
+    {
+        return false;
+    }
+
+    // Open from the archive or the image directory
+    TIFF* tif = NULL;
+    tiffMemory memory;
+    if (archive)
+    {
+        size_t length;
+        if (! archive->find(filename, memory.data, length))
+        {
+            return false;
+        }
+        memory.size = length;
+        memory.position = 0;
+        tif = TIFFClientOpen(filename.c_str(), "r", (thandle_t)&memory, tiffMemoryRead, tiffMemoryWrite, tiffMemorySeek, tiffMemoryClose, tiffMemorySize, tiffMemoryMap, tiffMemoryUnmap);
+    }
+    else
+    {
+        tif = TIFFOpen((imageLocation + filename).c_str(), "r");
+    }
+    if (tif == NULL)
+    {
+        return false;
+    }
+
+    // Only 8 bit grayscale stored top-down, which reads identically to cv::imread in grayscale
+    uint32 width = 0, height = 0;
+    uint16 bitsPerSample = 0, samplesPerPixel = 0, photometric = 0, orientation = 0, compression = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    if (! TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric) ||
+        (bitsPerSample != 8) || (samplesPerPixel != 1) || (photometric != PHOTOMETRIC_MINISBLACK) || (orientation != ORIENTATION_TOPLEFT) ||
+        ((uint32)(region.x + region.width) > width) || ((uint32)(region.y + region.height) > height))
+    {
+        TIFFClose(tif);
+        return false;
+    }
+
+    dst.create(region.height, region.width, CV_8UC1);
+    bool success = true;
+
+    if (TIFFIsTiled(tif))
+    {
+        // Read the tiles overlapping the region
+        uint32 tileWidth = 0, tileHeight = 0;
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tileWidth);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileHeight);
+        std::vector<unsigned char> tile(TIFFTileSize(tif));
+
+        uint32 firstY = (region.y / tileHeight) * tileHeight;
+        uint32 firstX = (region.x / tileWidth) * tileWidth;
+        for (uint32 y = firstY; success && (y < (uint32)(region.y + region.height)); y += tileHeight)
+        {
+            for (uint32 x = firstX; success && (x < (uint32)(region.x + region.width)); x += tileWidth)
+            {
+                success = (TIFFReadTile(tif, &tile[0], x, y, 0, 0) >= 0);
+
+                // Copy the part of the tile inside the region
+                cv::Rect tileRect(x, y, tileWidth, tileHeight);
+                cv::Rect overlap = tileRect & region;
+                for (int row = 0; success && (row < overlap.height); row++)
+                {
+                    const unsigned char* src = &tile[(overlap.y + row - y) * tileWidth + (overlap.x - x)];
+                    std::copy(src, src + overlap.width, dst.ptr(overlap.y + row - region.y) + (overlap.x - region.x));
+                }
+            }
+        }
+    }
+    else if (compression == COMPRESSION_NONE)
+    {
+        // Uncompressed scanlines can be read in any order: only the rows of the region
+        std::vector<unsigned char> scanline(TIFFScanlineSize(tif));
+        for (int row = 0; success && (row < region.height); row++)
+        {
+            success = (TIFFReadScanline(tif, &scanline[0], region.y + row, 0) >= 0);
+            std::copy(&scanline[region.x], &scanline[region.x] + region.width, dst.ptr(row));
+        }
+    }
+    else
+    {
+        // Compressed strips: only decode the strips holding the rows of the region
+        uint32 rowsPerStrip = height;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+        rowsPerStrip = std::min(rowsPerStrip, height);
+        std::vector<unsigned char> strip(TIFFStripSize(tif));
+
+        uint32 firstStrip = region.y / rowsPerStrip;
+        uint32 lastStrip = (region.y + region.height - 1) / rowsPerStrip;
+        for (uint32 s = firstStrip; success && (s <= lastStrip); s++)
+        {
+            success = (TIFFReadEncodedStrip(tif, s, &strip[0], (tmsize_t)-1) >= 0);
+
+            // Copy the rows of the strip inside the region
+            int stripStart = s * rowsPerStrip;
+            int first = std::max(stripStart, region.y);
+            int last = std::min(stripStart + (int)rowsPerStrip, region.y + region.height);
+            for (int row = first; success && (row < last); row++)
+            {
+                const unsigned char* src = &strip[(row - stripStart) * width + region.x];
+                std::copy(src, src + region.width, dst.ptr(row - region.y));
+            }
+        }
+    }
+
+    TIFFClose(tif);
+    return success;
+}
+
+#else
+
+// Built without libtiff: always decode the whole image
+bool imageLoader::loadTiffRegion(const std::string& /*filename*/, const cv::Rect& /*region*/, cv::Mat& /*dst*/)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,130 @@
+//
+//  imageLoader.hpp
+//  TCLDetection
+
+
+
+#ifndef imageLoader_hpp
+#define imageLoader_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include "stageProfile.hpp"
+
+
+// Best guess (bg) segmentation: box around the iris in a 640x480 image
+#define BG_X 195
+#define BG_Y 125
+#define BG_SIZE 250
+
+
+// Packed image archive: image files (and split lists) concatenated into one file, with an index mapping names to their bytes
+//
+// [header (32 bytes)][file contents, in packing order][index: per entry, uint32 name length + characters, uint64 offset, uint64 length]
+//
+// Reading one mapped archive replaces an open and stat per image, which dominates on network filesystems for small images.
+struct imageArchiveHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t indexOffset;
+};
+
+class imageArchive
+{
+public:
+    imageArchive(const std::string& filename);
+    ~imageArchive();
+
+    // Number of files in the archive
+    int size(void) const { return (int)index.size(); }
+
+    // Finds the bytes of a file, returns false if the archive does not hold it
+    bool find(const std::string& name, const unsigned char*& data, size_t& length) const;
+
+    // Packs files into a new archive: each pair is the name in the archive and the path of the file to copy
+    static void pack(const std::string& filename, const std::vector<std::pair<std::string, std::string> >& files);
+
+private:
+    std::string path;
+    void* mapping;
+    size_t mappingSize;
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t> > index;
+};
+
+
+// Loads the grayscale region of an image used for feature extraction (safe to use from several threads)
+class imageLoader
+{
+public:
+    // Images are read from the image directory, or from the packed archive if one is given
+    // Reading, decoding, cropping and downsampling are timed into the profile if one is given
+    imageLoader(const std::string& imageDir, const std::string& segmentationType, bool exactDownsampling = true, const std::string& archiveFilename = "", stageProfile* stageTimes = NULL);
+
+    // Returns the segmented grayscale image, throws if the image cannot be read
+    cv::Mat load(const std::string& filename);
+
+    // Returns the segmented image at half resolution, for when the full resolution is not needed.
+    // Exact: pyrDown of load(). Fast: decoded at half resolution by the decoder (JPEG) or averaged 2x2 from the TIFF box.
+    cv::Mat loadHalf(const std::string& filename);
+
+    // Halves the resolution of a segmented image: pyrDown (exact) or 2x2 averaging (fast)
+    cv::Mat halve(const cv::Mat& image);
+
+    // Whether half resolution images are pyrDown of the full resolution ones
+    bool exactDownsampling(void) const { return exact; }
+
+    // Number of images decoded partially (only the region used) and fully
+    std::atomic<int> partialDecodes;
+    std::atomic<int> fullDecodes;
+
+private:
+    std::string imageLocation;
+    std::string segmentation;
+    bool exact;
+    std::unique_ptr<imageArchive> archive;
+    stageProfile* profile;
+
+    // Decodes a whole image with OpenCV, from its file or from the archive
+    cv::Mat decode(const std::string& filename, int flags);
+
+    // Decodes only the rows, strips or tiles of a TIFF image covering a region
+    // Returns false if the file is not a TIFF this can handle, so it has to be decoded fully
+    bool loadTiffRegion(const std::string& filename, const cv::Rect& region, cv::Mat& dst);
+};
+
+
+// Gaussian pyramid of a segmented image, built lazily: level k is the image at 1/2^k resolution.
+// Shared by all feature sets of an image, so each level is decoded or downsampled once, even when the sets are extracted by several threads.
+class imagePyramid
+{
+public:
+    // The finest octave its users need: if above 0, the half resolution image may be produced without the full resolution one
+    // (with fast downsampling, the half resolution image always comes from loadHalf, so it does not depend on the finest octave)
+    imagePyramid(imageLoader& imageSource, const std::string& filename, int finestOctave = 0);
+
+    // The image at an octave (0: full resolution), computed from the level above on first use
+    cv::Mat level(int octave);
+
+private:
+    imageLoader& loader;
+    std::string name;
+    int finest;
+    std::vector<cv::Mat> levels;
+    std::mutex lock;
+
+    // level() with the lock held
+    cv::Mat build(int octave);
+};
+
+#endif /* imageLoader_hpp */
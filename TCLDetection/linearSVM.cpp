@@ -0,0 +1,176 @@
+//
+//  linearSVM.cpp
+//  TCLDetection
+
+
+
+#include "linearSVM.hpp"
+
+#include <stdexcept>
+
+
+using namespace std;
+
+
+linearSVM::linearSVM() : lambda(1e-4), epochs(5), shift(0)
+{
+}
+
+
+cv::Ptr<linearSVM> linearSVM::create(void)
+{
+    return cv::makePtr<linearSVM>();
+}
+
+
+void linearSVM::trainBatches(int rows, int cols, int batchRows, const std::vector<int>& labels, const std::function<cv::Mat(int, int)>& batch)
+{
+    if ((rows <= 0) || (batchRows <= 0) || (epochs <= 0) || (lambda <= 0))
+    {
+        throw runtime_error("Error: a linear SVM needs training rows, a positive batch size, epochs and regularization");
+    }
+
+    // Weights of the current iterate, and their average over the last epoch
+    std::vector<double> w(cols, 0.0);
+    std::vector<double> average(cols, 0.0);
+    double b = 0;
+    double averageShift = 0;
+    long long averaged = 0;
+
+    // Step size eta0 / (1 + lambda eta0 t): rows are z-score normalized, so their squared norm is about cols
+    double eta0 = 1.0 / cols;
+    long long t = 0;
+
+    int numBatches = (rows + batchRows - 1) / batchRows;
+    std::vector<int> batchOrder(numBatches);
+    for (int i = 0; i < numBatches; i++)
+    {
+        batchOrder[i] = i;
+    }
+    cv::RNG rng;
+
+    for (int epoch = 0; epoch < epochs; epoch++)
+    {
+        bool averaging = (epoch == epochs - 1);
+
+        // Fisher-Yates shuffles of the batches and of the rows of each batch
+        for (int i = numBatches - 1; i > 0; i--)
+        {
+            std::swap(batchOrder[i], batchOrder[rng.uniform(0, i + 1)]);
+        }
+
+        for (int n = 0; n < numBatches; n++)
+        {
+            int first = batchOrder[n] * batchRows;
+            int last = std::min(first + batchRows, rows);
+            cv::Mat samples = batch(first, last);
+            if ((samples.rows != last - first) || (samples.cols != cols) || (samples.type() != CV_32FC1))
+            {
+                throw runtime_error("Error: unexpected batch of features for a linear SVM");
+            }
+
+            std::vector<int> rowOrder(samples.rows);
+            for (int i = 0; i < samples.rows; i++)
+            {
+                rowOrder[i] = i;
+            }
+            for (int i = samples.rows - 1; i > 0; i--)
+            {
+                std::swap(rowOrder[i], rowOrder[rng.uniform(0, i + 1)]);
+            }
+
+            for (int r = 0; r < samples.rows; r++)
+            {
+                const float* x = samples.ptr<float>(rowOrder[r]);
+                double y = (labels[first + rowOrder[r]] == 1) ? 1.0 : -1.0;
+
+                double eta = eta0 / (1.0 + lambda * eta0 * t);
+                t++;
+
+                double margin = b;
+                for (int j = 0; j < cols; j++)
+                {
+                    margin += w[j] * x[j];
+                }
+                margin *= y;
+
+                // Regularization shrinks the weights; a row inside the margin pulls them towards its side
+                double decay = 1.0 - eta * lambda;
+                if (margin < 1)
+                {
+                    for (int j = 0; j < cols; j++)
+                    {
+                        w[j] = w[j] * decay + eta * y * x[j];
+                    }
+                    b += eta * y;
+                }
+                else
+                {
+                    for (int j = 0; j < cols; j++)
+                    {
+                        w[j] *= decay;
+                    }
+                }
+
+                if (averaging)
+                {
+                    averaged++;
+                    for (int j = 0; j < cols; j++)
+                    {
+                        average[j] += (w[j] - average[j]) / averaged;
+                    }
+                    averageShift += (b - averageShift) / averaged;
+                }
+            }
+        }
+    }
+
+    weights.create(1, cols, CV_32FC1);
+    for (int j = 0; j < cols; j++)
+    {
+        weights.at<float>(0, j) = (float)average[j];
+    }
+    shift = averageShift;
+}
+
+
+float linearSVM::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat rows = samples.getMat();
+    if ((rows.cols != weights.cols) || (rows.type() != CV_32FC1))
+    {
+        throw runtime_error("Error: samples do not match the linear SVM");
+    }
+
+    cv::Mat values(rows.rows, 1, CV_32FC1);
+    for (int i = 0; i < rows.rows; i++)
+    {
+        double value = shift + rows.row(i).dot(weights);
+        values.at<float>(i, 0) = (flags & RAW_OUTPUT) ? (float)value : (float)(value > 0);
+    }
+
+    if (results.needed())
+    {
+        values.copyTo(results);
+    }
+    return values.empty() ? 0 : values.at<float>(0, 0);
+}
+
+
+void linearSVM::write(cv::FileStorage& fs) const
+{
+    writeFormat(fs);
+    fs << "lambda" << lambda;
+    fs << "epochs" << epochs;
+    fs << "shift" << shift;
+    fs << "weights" << weights;
+}
+
+
+void linearSVM::read(const cv::FileNode& fn)
+{
+    lambda = (double)fn["lambda"];
+    epochs = (int)fn["epochs"];
+    shift = (double)fn["shift"];
+    fn["weights"] >> weights;
+}
@@ -0,0 +1,53 @@
+//
+//  linearSVM.hpp
+//  TCLDetection
+
+
+
+#ifndef linearSVM_hpp
+#define linearSVM_hpp
+
+#include <vector>
+#include <functional>
+#include "opencv2/core.hpp"
+#include "opencv2/ml.hpp"
+
+
+// Linear SVM trained out of core by stochastic gradient descent (hinge loss, L2 regularization, averaged weights):
+// training rows are requested a batch at a time, so the training set never has to fit in memory.
+// Saved and loaded like the OpenCV models (Algorithm::load<linearSVM>), and predicts classes 0 and 1 like them.
+class linearSVM : public cv::ml::StatModel
+{
+public:
+    linearSVM();
+
+    static cv::Ptr<linearSVM> create(void);
+
+    // Regularization (lambda) and number of passes over the training set
+    void setRegularization(double value) { lambda = value; }
+    void setEpochs(int value) { epochs = value; }
+
+    // Trains on rows requested by batch(first, last), which returns the normalized features of rows first to last - 1
+    // Labels holds the class (0 or 1) of every row. Batches, and rows within a batch, are visited in a new random order
+    // every epoch (the same orders on every run). The weights are averaged over the last epoch.
+    void trainBatches(int rows, int cols, int batchRows, const std::vector<int>& labels, const std::function<cv::Mat(int, int)>& batch);
+
+    // Classes of rows (RAW_OUTPUT: their signed distances to the hyperplane), returns the result of the first row
+    float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(), int flags = 0) const;
+
+    int getVarCount() const { return weights.cols; }
+    bool isTrained() const { return ! weights.empty(); }
+    bool isClassifier() const { return true; }
+
+    void write(cv::FileStorage& fs) const;
+    void read(const cv::FileNode& fn);
+    cv::String getDefaultName() const { return "tcl_linear_svm"; }
+
+private:
+    double lambda;
+    int epochs;
+    cv::Mat weights;
+    double shift;
+};
+
+#endif /* linearSVM_hpp */
@@ -0,0 +1,72 @@
+//
+//  packArchive.cpp
+//  TCLDetection
+
+
+
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+#include "imageLoader.hpp"
+#include "splitList.hpp"
+
+
+using namespace std;
+
+
+// Packs the images listed in split files (filename,class lines) into one image archive, along with the split files themselves
+int main(int argc, char *argv[]) {
+
+    if (argc < 4)
+    {
+        cout << "Usage: packArchive archive.tclpack imageDirectory split.csv [split.csv ...]" << endl;
+        cout << "Packs the images listed in the splits (and the splits, under their filenames) into one archive" << endl;
+        return 0;
+    }
+
+    std::string archiveFilename = argv[1];
+    std::string imageDir = argv[2];
+
+    // Archive entries: name in the archive, file to copy
+    std::vector<std::pair<std::string, std::string> > files;
+    std::unordered_set<std::string> packed;
+
+    try
+    {
+        for (int i = 3; i < argc; i++)
+        {
+            std::string splitPath = argv[i];
+
+            // Images of the split, each packed once even if listed in several splits
+            std::vector<std::string> imageNames;
+            std::vector<int> classes;
+            loadSplitFile(splitPath, false, imageNames, classes);
+            for (int n = 0; n < (int)imageNames.size(); n++)
+            {
+                if (! imageNames[n].empty() && packed.insert(imageNames[n]).second)
+                {
+                    files.push_back(std::make_pair(imageNames[n], imageDir + imageNames[n]));
+                }
+            }
+
+            // The split itself, under its filename (as given in the configuration file)
+            string splitName = splitPath.substr(splitPath.find_last_of('/') + 1);
+            if (packed.insert(splitName).second)
+            {
+                files.push_back(std::make_pair(splitName, splitPath));
+            }
+        }
+
+        cout << "Packing " << files.size() << " files into " << archiveFilename << "..." << endl;
+        imageArchive::pack(archiveFilename, files);
+    }
+    catch (runtime_error& e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+
+
+}
@@ -0,0 +1,138 @@
+//
+//  splitList.cpp
+//  TCLDetection
+
+
+
+#include "splitList.hpp"
+
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+void parseSplit(const char* data, size_t length, const std::string& splitName, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes)
+{
+    const char* end = data + length;
+
+    // Count lines first, so the lists are allocated once
+    size_t numLines = 0;
+    for (const char* p = data; (p < end) && ((p = (const char*)memchr(p, '\n', end - p)) != NULL); p++)
+    {
+        numLines++;
+    }
+    names.reserve(names.size() + numLines + 1);
+    if (withClasses)
+    {
+        classes.reserve(classes.size() + numLines + 1);
+    }
+
+    int lineNumber = 0;
+    const char* line = data;
+    while (line < end)
+    {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+        lineNumber++;
+
+        // Ignore the carriage return of CRLF files
+        const char* contentEnd = lineEnd;
+        if ((contentEnd > line) && (contentEnd[-1] == '\r'))
+        {
+            contentEnd--;
+        }
+
+        if (contentEnd > line)
+        {
+            const char* comma = (const char*)memchr(line, ',', contentEnd - line);
+            const char* nameEnd = (comma != NULL) ? comma : contentEnd;
+            names.push_back(std::string(line, nameEnd - line));
+
+            if (withClasses)
+            {
+                // Class: an optionally signed integer, surrounding spaces allowed
+                const char* p = (comma != NULL) ? comma + 1 : contentEnd;
+                while ((p < contentEnd) && (*p == ' '))
+                {
+                    p++;
+                }
+                bool negative = (p < contentEnd) && (*p == '-');
+                if ((p < contentEnd) && ((*p == '-') || (*p == '+')))
+                {
+                    p++;
+                }
+                long value = 0;
+                const char* digits = p;
+                while ((p < contentEnd) && (*p >= '0') && (*p <= '9') && (value <= INT_MAX))
+                {
+                    value = value * 10 + (*p - '0');
+                    p++;
+                }
+                bool valid = (p > digits) && (value <= INT_MAX);
+                while ((p < contentEnd) && (*p == ' '))
+                {
+                    p++;
+                }
+                if (! valid || (p != contentEnd))
+                {
+                    throw runtime_error("Error: invalid class on line " + std::to_string(lineNumber) + " of " + splitName);
+                }
+                classes.push_back(negative ? -(int)value : (int)value);
+            }
+        }
+
+        line = lineEnd + 1;
+    }
+}
+
+
+void loadSplitFile(const std::string& filename, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Error: split not found in " + filename);
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0)
+    {
+        ::close(fd);
+        throw runtime_error("Error: unable to read split " + filename);
+    }
+    size_t length = fileInfo.st_size;
+    if (length == 0)
+    {
+        ::close(fd);
+        return;
+    }
+
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw runtime_error("Error: unable to map split " + filename);
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    try
+    {
+        parseSplit((const char*)mapping, length, filename, withClasses, names, classes);
+    }
+    catch (...)
+    {
+        munmap(mapping, length);
+        throw;
+    }
+    munmap(mapping, length);
+}
@@ -0,0 +1,22 @@
+//
+//  splitList.hpp
+//  TCLDetection
+
+
+
+#ifndef splitList_hpp
+#define splitList_hpp
+
+#include <string>
+#include <vector>
+
+
+// Parses a split (one "filename,class" line per image) held in memory, in one pass over its bytes:
+// lines and cells are located in place, each name is built once straight from the bytes, and classes are
+// parsed and validated as they go. Blank lines are skipped; a missing or invalid class throws, naming the line.
+void parseSplit(const char* data, size_t length, const std::string& splitName, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes);
+
+// Maps a split file and parses it
+void loadSplitFile(const std::string& filename, bool withClasses, std::vector<std::string>& names, std::vector<int>& classes);
+
+#endif /* splitList_hpp */
@@ -0,0 +1,61 @@
+//
+//  stageProfile.cpp
+//  TCLDetection
+
+
+
+#include "stageProfile.hpp"
+
+
+static const char* stageNames[STAGE_COUNT] = {"read", "decode", "crop", "downsample", "border", "convolution", "threshold", "histogram", "write"};
+
+const char* stageName(int stage)
+{
+    return stageNames[stage];
+}
+
+
+stageProfile::stageProfile()
+{
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        nanoseconds[s] = 0;
+        numCalls[s] = 0;
+    }
+}
+
+
+void stageProfile::add(int stage, std::chrono::steady_clock::duration elapsed)
+{
+    nanoseconds[stage].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+    numCalls[stage].fetch_add(1, std::memory_order_relaxed);
+}
+
+
+double stageProfile::seconds(int stage) const
+{
+    return nanoseconds[stage] * 1e-9;
+}
+
+
+long long stageProfile::calls(int stage) const
+{
+    return numCalls[stage];
+}
+
+
+void stageProfile::writeJSON(std::ostream& out, const std::string& indent) const
+{
+    out << "{";
+    bool first = true;
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        if (numCalls[s] == 0)
+        {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << indent << "  \"" << stageNames[s] << "\": {\"seconds\": " << seconds(s) << ", \"calls\": " << calls(s) << "}";
+        first = false;
+    }
+    out << (first ? "}" : "\n" + indent + "}");
+}
@@ -0,0 +1,84 @@
+//
+//  stageProfile.hpp
+//  TCLDetection
+
+
+
+#ifndef stageProfile_hpp
+#define stageProfile_hpp
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+
+// Stages of feature extraction, timed separately
+enum extractionStage
+{
+    STAGE_READ,         // reading the image file (or finding it in the archive)
+    STAGE_DECODE,       // decoding (for TIFF images decoded partially, including their reads)
+    STAGE_CROP,         // segmentation
+    STAGE_DOWNSAMPLE,   // pyramid levels
+    STAGE_BORDER,       // wrapped border around the image
+    STAGE_CONVOLUTION,  // one filter of the bank (one call per bit)
+    STAGE_THRESHOLD,    // binarizing one filter response into the code image
+    STAGE_HISTOGRAM,    // counting the codes
+    STAGE_WRITE,        // storing the histogram in the feature file
+    STAGE_COUNT
+};
+
+// Name of a stage in reports
+const char* stageName(int stage);
+
+
+// Accumulated time and number of calls of each stage, updated from any thread
+class stageProfile
+{
+public:
+    stageProfile();
+
+    void add(int stage, std::chrono::steady_clock::duration elapsed);
+
+    double seconds(int stage) const;
+    long long calls(int stage) const;
+
+    // Writes {"stage": {"seconds": s, "calls": n}, ...} for the stages that were called
+    void writeJSON(std::ostream& out, const std::string& indent) const;
+
+private:
+    std::atomic<long long> nanoseconds[STAGE_COUNT];
+    std::atomic<long long> numCalls[STAGE_COUNT];
+};
+
+
+// Times a stage from its construction to stop() or its destruction; does nothing without a profile
+class stageTimer
+{
+public:
+    stageTimer(stageProfile* stageTimes, int timedStage) : profile(stageTimes), stage(timedStage)
+    {
+        if (profile != NULL)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~stageTimer() { stop(); }
+
+    void stop(void)
+    {
+        if (profile != NULL)
+        {
+            profile->add(stage, std::chrono::steady_clock::now() - start);
+            profile = NULL;
+        }
+    }
+
+private:
+    stageProfile* profile;
+    int stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif /* stageProfile_hpp */
@@ -0,0 +1,149 @@
+//
+//  taskScheduler.cpp
+//  TCLDetection
+
+
+
+#include "taskScheduler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+
+taskScheduler::taskScheduler(int threads) : numThreads(threads)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+}
+
+
+void taskScheduler::add(double cost, std::function<void()> work)
+{
+    queuedTask task;
+    task.cost = cost;
+    task.work = work;
+    tasks.push_back(task);
+}
+
+
+bool taskScheduler::take(std::deque<int>& queue, std::mutex& lock, int& task)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (queue.empty())
+    {
+        return false;
+    }
+    task = queue.front();
+    queue.pop_front();
+    return true;
+}
+
+
+void taskScheduler::run(void)
+{
+    // Most expensive first (ties keep the order they were added in)
+    std::stable_sort(tasks.begin(), tasks.end(), [](const queuedTask& a, const queuedTask& b) { return a.cost > b.cost; });
+
+    int workers = std::min(numThreads, (int)tasks.size());
+    if (workers <= 1)
+    {
+        // Nothing to share: run in the calling thread
+        std::vector<queuedTask> batch;
+        batch.swap(tasks);
+        for (int t = 0; t < (int)batch.size(); t++)
+        {
+            batch[t].work();
+        }
+        return;
+    }
+
+    // Deal the tasks round-robin, so every queue is sorted by decreasing cost and holds a similar share of the work
+    std::vector<std::deque<int> > queues(workers);
+    std::vector<std::mutex> locks(workers);
+    for (int t = 0; t < (int)tasks.size(); t++)
+    {
+        queues[t % workers].push_back(t);
+    }
+
+    std::atomic<bool> failed(false);
+    std::exception_ptr firstError;
+    std::mutex errorLock;
+
+    auto worker = [&](int w)
+    {
+        int task;
+        while (! failed)
+        {
+            // Own queue first, then steal from the others, starting with the next thread
+            bool found = take(queues[w], locks[w], task);
+            for (int v = 1; ! found && (v < workers); v++)
+            {
+                found = take(queues[(w + v) % workers], locks[(w + v) % workers], task);
+            }
+            if (! found)
+            {
+                // No new tasks are added during a run: all queues empty means this thread is done
+                return;
+            }
+
+            try
+            {
+                tasks[task].work();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (! firstError)
+                {
+                    firstError = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int w = 1; w < workers; w++)
+    {
+        threads.push_back(std::thread(worker, w));
+    }
+    worker(0);
+    for (int w = 0; w < (int)threads.size(); w++)
+    {
+        threads[w].join();
+    }
+
+    tasks.clear();
+    if (firstError)
+    {
+        std::rethrow_exception(firstError);
+    }
+}
+
+
+memoryBudget::memoryBudget(size_t bytes) : capacity(bytes), used(0)
+{
+}
+
+
+void memoryBudget::acquire(size_t bytes)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (capacity > 0)
+    {
+        freed.wait(guard, [&]() { return (used == 0) || (used + bytes <= capacity); });
+    }
+    used += bytes;
+}
+
+
+void memoryBudget::release(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        used -= bytes;
+    }
+    freed.notify_all();
+}
@@ -0,0 +1,88 @@
+//
+//  taskScheduler.hpp
+//  TCLDetection
+
+
+
+#ifndef taskScheduler_hpp
+#define taskScheduler_hpp
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+
+// Work-stealing thread pool for batches of independent tasks of uneven cost.
+// Tasks are sorted by estimated cost and dealt round-robin to one queue per thread, so the most expensive tasks start first
+// and the cheap ones fill the gaps at the end. A thread whose queue runs dry steals the most expensive task left in another queue.
+class taskScheduler
+{
+public:
+    // Number of threads: 0 uses one per core
+    taskScheduler(int threads = 0);
+
+    int threadCount(void) const { return numThreads; }
+
+    // Queues a task for the next run, with its estimated cost (any unit, only the order matters)
+    void add(double cost, std::function<void()> work);
+
+    // Runs the queued tasks and waits for all of them to finish
+    // If a task throws, the tasks not yet started are dropped and the first exception is rethrown
+    void run(void);
+
+private:
+    struct queuedTask
+    {
+        double cost;
+        std::function<void()> work;
+    };
+
+    int numThreads;
+    std::vector<queuedTask> tasks;
+
+    // Takes the next task of a queue (its most expensive one), returns false if the queue is empty
+    static bool take(std::deque<int>& queue, std::mutex& lock, int& task);
+};
+
+
+// Memory shared by tasks running at the same time: each task reserves its estimated peak before starting,
+// and waits while the reservations of the running tasks leave no room for it.
+// A task larger than the whole budget runs once nothing else holds memory, so every task eventually runs.
+class memoryBudget
+{
+public:
+    // Budget in bytes: 0 for no limit
+    memoryBudget(size_t bytes = 0);
+
+    // Blocks until the bytes fit in the budget, then reserves them
+    void acquire(size_t bytes);
+
+    // Returns bytes reserved by acquire
+    void release(size_t bytes);
+
+private:
+    size_t capacity;
+    size_t used;
+    std::mutex lock;
+    std::condition_variable freed;
+};
+
+// Reservation held for the lifetime of the object (released even if the task throws)
+class memoryReservation
+{
+public:
+    memoryReservation(memoryBudget& memory, size_t bytes) : budget(memory), reserved(bytes) { budget.acquire(reserved); }
+    ~memoryReservation() { budget.release(reserved); }
+
+private:
+    memoryBudget& budget;
+    size_t reserved;
+
+    memoryReservation(const memoryReservation&);
+    memoryReservation& operator=(const memoryReservation&);
+};
+
+#endif /* taskScheduler_hpp */